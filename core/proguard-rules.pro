@@ -7,6 +7,9 @@
 -keep class org.lsposed.lspd.hooker.HandleSystemServerProcessHooker$Callback {*;}
 -keep class org.lsposed.lspd.impl.LSPosedBridge$NativeHooker {*;}
 -keep class org.lsposed.lspd.impl.LSPosedBridge$HookerCallback {*;}
+-keep class org.lsposed.lspd.impl.LSPosedLazyHooks {
+    static void onClassDefined(java.lang.Class);
+}
 -keep class org.lsposed.lspd.util.Hookers {*;}
 
 -keepnames class org.lsposed.lspd.impl.LSPosedHelper {
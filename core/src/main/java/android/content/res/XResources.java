@@ -20,6 +20,7 @@
 
 package android.content.res;
 
+import static org.lsposed.lspd.nativebridge.ResourcesHook.invalidateTranslations;
 import static org.lsposed.lspd.nativebridge.ResourcesHook.rewriteXmlReferencesNative;
 import static de.robv.android.xposed.XposedHelpers.decrementMethodDepth;
 import static de.robv.android.xposed.XposedHelpers.findAndHookMethod;
@@ -100,6 +101,8 @@ public class XResources extends XResourcesSuperClass {
 	private static final HashMap<String, Long> sResDirLastModified = new HashMap<>();
 	private static final HashMap<String, String> sResDirPackageNames = new HashMap<>();
 	private static ThreadLocal<Object> sLatestResKey = null;
+	private static final WeakHashMap<Resources, Integer> sTranslationKeys = new WeakHashMap<>();
+	private static int sLastTranslationKey = 0;
 
 	private String mResDir;
 	private String mPackageName;
@@ -145,6 +148,7 @@ public class XResources extends XResourcesSuperClass {
 				sReplacements.valueAt(i).remove(mResDir);
 			}
 			Arrays.fill(mReplacementsCache, (byte) 0);
+			invalidateTranslations();
 			return true;
 		}
 	}
@@ -580,6 +584,13 @@ public class XResources extends XResourcesSuperClass {
 		if (replacement instanceof Drawable)
 			throw new IllegalArgumentException("Drawable replacements are deprecated since Xposed 2.1. Use DrawableLoader instead.");
 
+		putReplacement(id, replacement, res);
+		// a cached translation may have set the replacement this one overrides
+		invalidateTranslations();
+	}
+
+	private static void putReplacement(int id, Object replacement, XResources res) {
+		String resDir = (res != null) ? res.mResDir : null;
 		// Cache that we have a replacement for this ID, false positives are accepted to save memory.
 		if (id < 0x7f000000) {
 			int cacheKey = (id & 0x00070000) >> 11 | (id & 0xf8) >> 3;
@@ -651,7 +662,7 @@ public class XResources extends XResourcesSuperClass {
 
 			if (!loadedFromCache) {
 				long parseState = getLongField(result, "mParseState");
-				rewriteXmlReferencesNative(parseState, this, repRes);
+				rewriteXmlReferences(parseState, repRes, repId);
 			}
 
 			return result;
@@ -940,7 +951,7 @@ public class XResources extends XResourcesSuperClass {
 
 			if (!loadedFromCache) {
 				long parseState = getLongField(result, "mParseState");
-				rewriteXmlReferencesNative(parseState, this, repRes);
+				rewriteXmlReferences(parseState, repRes, repId);
 			}
 		} else {
 			result = super.getLayout(id);
@@ -1126,7 +1137,7 @@ public class XResources extends XResourcesSuperClass {
 
 			if (!loadedFromCache) {
 				long parseState = getLongField(result, "mParseState");
-				rewriteXmlReferencesNative(parseState, this, repRes);
+				rewriteXmlReferences(parseState, repRes, repId);
 			}
 
 			return result;
@@ -1134,6 +1145,27 @@ public class XResources extends XResourcesSuperClass {
 		return super.getXml(id);
 	}
 
+	private void rewriteXmlReferences(long parseState, Resources repRes, int repId) {
+		long translationKey;
+		synchronized (sTranslationKeys) {
+			translationKey = (long) getTranslationKey(this) << 32 | getTranslationKey(repRes);
+		}
+		rewriteXmlReferencesNative(parseState, translationKey, repId, this, repRes);
+	}
+
+	/**
+	 * Identifies resources in the native cache of {@link #translateResId} and {@link #translateAttrId}
+	 * results. Keys are never reused, so entries of collected resources can't be hit again.
+	 */
+	private static int getTranslationKey(Resources res) {
+		Integer key = sTranslationKeys.get(res);
+		if (key == null) {
+			key = ++sLastTranslationKey;
+			sTranslationKeys.put(res, key);
+		}
+		return key;
+	}
+
 	private static boolean isXmlCached(Resources res, int id) {
 		int[] mCachedXmlBlockIds = (int[]) getObjectField(getObjectField(res, "mResourcesImpl"), "mCachedXmlBlockCookies");
 		synchronized (mCachedXmlBlockIds) {
@@ -1183,8 +1215,9 @@ public class XResources extends XResourcesSuperClass {
 				origResId = getFakeResId(repRes, id);
 
 			// IDs will never be loaded, no need to set a replacement
+			// the result is cached natively, so this must not invalidate the cache
 			if (repResDefined && !entryType.equals("id"))
-				origRes.setReplacement(origResId, new XResForwarder(repRes, id));
+				putReplacement(origResId, new XResForwarder(repRes, id), origRes);
 
 			return origResId;
 		} catch (Exception e) {
@@ -22,6 +22,7 @@ package de.robv.android.xposed;
 
 import java.lang.reflect.Executable;
 import java.lang.reflect.Member;
+import java.util.Arrays;
 import java.util.HashMap;
 
 import de.robv.android.xposed.callbacks.IXUnhook;
@@ -34,12 +35,18 @@ import de.robv.android.xposed.callbacks.XCallback;
  * {@link #beforeHookedMethod} and/or {@link #afterHookedMethod}.
  */
 public abstract class XC_MethodHook extends XCallback {
+    /**
+     * Optional guard of this callback, see {@link Guard}.
+     */
+    public final Guard guard;
+
     /**
      * Creates a new callback with default priority.
      */
     @SuppressWarnings("deprecation")
     public XC_MethodHook() {
         super();
+        this.guard = null;
     }
 
     /**
@@ -54,6 +61,76 @@ public abstract class XC_MethodHook extends XCallback {
      */
     public XC_MethodHook(int priority) {
         super(priority);
+        this.guard = null;
+    }
+
+    /**
+     * Creates a new callback with a specific priority that is only called when its guard holds.
+     *
+     * @param priority See {@link XCallback#priority}.
+     * @param guard    Conditions checked natively before the callback is dispatched.
+     */
+    public XC_MethodHook(int priority, Guard guard) {
+        super(priority);
+        this.guard = guard;
+    }
+
+    /**
+     * Conditions on the arguments of a hooked method, evaluated natively before any Java code runs.
+     * The callback is only called when all of them hold. If no callback of an invocation passes its
+     * guard, the original method is called directly.
+     *
+     * <p>Argument indexes don't count {@code this}. Values compared by {@link #argEquals} must be
+     * a boxed primitive matching the parameter type or a {@link String}. Invalid guards make
+     * {@link XposedBridge#hookMethod} throw an {@link IllegalArgumentException}.
+     */
+    public static final class Guard {
+        static final int ARG_NULL = 0;
+        static final int ARG_NOT_NULL = 1;
+        static final int ARG_INSTANCE_OF = 2;
+        static final int ARG_EQUALS = 3;
+
+        // pairs of (op, argument index), read natively
+        int[] ops = new int[0];
+        Object[] operands = new Object[0];
+        boolean notReentrant = false;
+
+        public Guard argIsNull(int index) {
+            return add(ARG_NULL, index, null);
+        }
+
+        public Guard argNotNull(int index) {
+            return add(ARG_NOT_NULL, index, null);
+        }
+
+        public Guard argInstanceOf(int index, Class<?> clazz) {
+            if (clazz == null) throw new IllegalArgumentException("clazz should not be null");
+            return add(ARG_INSTANCE_OF, index, clazz);
+        }
+
+        public Guard argEquals(int index, Object value) {
+            if (value == null) return argIsNull(index);
+            return add(ARG_EQUALS, index, value);
+        }
+
+        /**
+         * Skips the callback while the hooked method is already running its callbacks on the
+         * current thread, e.g. when a callback calls the method again.
+         */
+        public Guard notReentrant() {
+            notReentrant = true;
+            return this;
+        }
+
+        private Guard add(int op, int index, Object operand) {
+            if (index < 0) throw new IllegalArgumentException("Negative argument index " + index);
+            ops = Arrays.copyOf(ops, ops.length + 2);
+            ops[ops.length - 2] = op;
+            ops[ops.length - 1] = index;
+            operands = Arrays.copyOf(operands, operands.length + 1);
+            operands[operands.length - 1] = operand;
+            return this;
+        }
     }
 
     /**
@@ -25,11 +25,16 @@ import android.content.res.Resources;
 import android.content.res.TypedArray;
 import android.util.Log;
 
+import dalvik.system.InMemoryDexClassLoader;
+
+import org.lsposed.lspd.core.ApplicationServiceClient;
+import org.lsposed.lspd.deopt.HookedCallersDeopter;
 import org.lsposed.lspd.impl.LSPosedBridge;
 import org.lsposed.lspd.impl.LSPosedHookCallback;
 import org.lsposed.lspd.nativebridge.HookBridge;
 import org.lsposed.lspd.nativebridge.ResourcesHook;
 
+import java.io.FileInputStream;
 import java.lang.reflect.AccessibleObject;
 import java.lang.reflect.Executable;
 import java.lang.reflect.InvocationTargetException;
@@ -37,6 +42,7 @@ import java.lang.reflect.Member;
 import java.lang.reflect.Method;
 import java.lang.reflect.Modifier;
 import java.lang.reflect.Proxy;
+import java.nio.channels.FileChannel;
 import java.util.Arrays;
 import java.util.HashSet;
 import java.util.Set;
@@ -119,7 +125,7 @@ public final class XposedBridge {
             ResourcesHook.makeInheritable(taClass);
             ClassLoader myCL = XposedBridge.class.getClassLoader();
             assert myCL != null;
-            dummyClassLoader = ResourcesHook.buildDummyClassLoader(myCL.getParent(), resClass.getName(), taClass.getName());
+            dummyClassLoader = buildDummyClassLoader(myCL.getParent(), resClass.getName(), taClass.getName());
             dummyClassLoader.loadClass("xposed.dummy.XResourcesSuperClass");
             dummyClassLoader.loadClass("xposed.dummy.XTypedArraySuperClass");
             XposedHelpers.setObjectField(myCL, "parent", dummyClassLoader);
@@ -129,6 +135,25 @@ public final class XposedBridge {
         }
     }
 
+    // Prefers the dex the daemon built for all processes and builds it here only if that fails
+    private static ClassLoader buildDummyClassLoader(ClassLoader parent, String resourceSuperClass, String typedArraySuperClass) {
+        var client = ApplicationServiceClient.serviceClient;
+        if (client != null) {
+            try (var dex = client.requestDummyDex(resourceSuperClass, typedArraySuperClass)) {
+                if (dex != null) {
+                    try (var in = new FileInputStream(dex.getFileDescriptor())) {
+                        var channel = in.getChannel();
+                        var image = channel.map(FileChannel.MapMode.READ_ONLY, 0, channel.size());
+                        return new InMemoryDexClassLoader(image, parent);
+                    }
+                }
+            } catch (Throwable t) {
+                log("Failed to load the shared dummy dex: " + t);
+            }
+        }
+        return ResourcesHook.buildDummyClassLoader(parent, resourceSuperClass, typedArraySuperClass);
+    }
+
     /**
      * Returns the currently installed version of the Xposed framework.
      */
@@ -178,6 +203,19 @@ public final class XposedBridge {
         HookBridge.deoptimizeMethod((Executable) deoptimizedMethod);
     }
 
+    /**
+     * Deoptimize every method of the given apks that directly invokes a currently hooked method,
+     * so that none of them keeps running an inlined copy of the original. Call it after the hooks
+     * are in place; callers are resolved through the class loader, which loads their classes.
+     *
+     * @param classLoader The class loader the apks are loaded by.
+     * @param apkPaths    The apks whose dex files are scanned for callers.
+     * @return The number of deoptimized callers.
+     */
+    public static int deoptimizeCallersOfHookedMethods(ClassLoader classLoader, String... apkPaths) {
+        return HookedCallersDeopter.deoptCallers(classLoader, apkPaths);
+    }
+
     /**
      * Hook any method (or constructor) with the specified callback. See below for some wrappers
      * that make it easier to find a method/constructor in one step.
@@ -207,7 +245,7 @@ public final class XposedBridge {
             throw new IllegalArgumentException("callback should not be null!");
         }
 
-        if (!HookBridge.hookMethod(false, (Executable) hookMethod, LSPosedBridge.NativeHooker.class, callback.priority, callback)) {
+        if (!HookBridge.hookMethod(false, (Executable) hookMethod, LSPosedBridge.NativeHooker.class, callback.priority, callback, callback.guard)) {
             log("Failed to hook " + hookMethod);
             return null;
         }
@@ -28,6 +28,7 @@ import androidx.annotation.Nullable;
 
 import org.apache.commons.lang3.ClassUtilsX;
 import org.apache.commons.lang3.reflect.MemberUtilsX;
+import org.lsposed.lspd.impl.LSPosedLazyHooks;
 
 import java.io.ByteArrayOutputStream;
 import java.io.FileInputStream;
@@ -390,6 +391,31 @@ public final class XposedHelpers {
         return findAndHookMethod(findClass(className, classLoader), methodName, parameterTypesAndCallback);
     }
 
+    /**
+     * Like {@link #findAndHookMethod(String, ClassLoader, String, Object...)}, but neither loads
+     * the class nor hooks the method before the class gets defined by {@code classLoader} or
+     * one of its parents. Hooks on classes that are never used cost nothing this way.
+     *
+     * <p>Lookup failures are logged instead of thrown, as they happen later. Boot classes are
+     * hooked right away, whatever {@code classLoader} is, and so is everything when class
+     * definitions cannot be watched on this device. Classes defined before are hooked once the
+     * module callback registering them returns.
+     *
+     * @param className                 The name of the class which implements the method.
+     * @param classLoader               The class loader for resolving the target and parameter classes.
+     * @param methodName                The target method name.
+     * @param parameterTypesAndCallback The parameter types of the target method, plus the callback.
+     */
+    public static void findAndHookMethodWhenDefined(String className, ClassLoader classLoader, String methodName, Object... parameterTypesAndCallback) {
+        if (parameterTypesAndCallback.length == 0 || !(parameterTypesAndCallback[parameterTypesAndCallback.length - 1] instanceof XC_MethodHook))
+            throw new IllegalArgumentException("no callback defined");
+        if (classLoader == null) {
+            findAndHookMethod(className, null, methodName, parameterTypesAndCallback);
+            return;
+        }
+        LSPosedLazyHooks.hookWhenDefined(className, classLoader, methodName, parameterTypesAndCallback);
+    }
+
     /**
      * Look up a method in a class and set it to accessible.
      * See {@link #findMethodExact(String, ClassLoader, String, Object...)} for details.
@@ -743,6 +769,20 @@ public final class XposedHelpers {
         return findAndHookConstructor(findClass(className, classLoader), parameterTypesAndCallback);
     }
 
+    /**
+     * Look up a constructor and hook it once its class gets defined. See
+     * {@link #findAndHookMethodWhenDefined(String, ClassLoader, String, Object...)} for details.
+     */
+    public static void findAndHookConstructorWhenDefined(String className, ClassLoader classLoader, Object... parameterTypesAndCallback) {
+        if (parameterTypesAndCallback.length == 0 || !(parameterTypesAndCallback[parameterTypesAndCallback.length - 1] instanceof XC_MethodHook))
+            throw new IllegalArgumentException("no callback defined");
+        if (classLoader == null) {
+            findAndHookConstructor(className, null, parameterTypesAndCallback);
+            return;
+        }
+        LSPosedLazyHooks.hookWhenDefined(className, classLoader, null, parameterTypesAndCallback);
+    }
+
     /**
      * Look up a constructor in a class and set it to accessible.
      *
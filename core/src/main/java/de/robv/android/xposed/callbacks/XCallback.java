@@ -23,6 +23,7 @@ package de.robv.android.xposed.callbacks;
 import android.os.Bundle;
 
 import org.lsposed.lspd.deopt.PrebuiltMethodsDeopter;
+import org.lsposed.lspd.impl.LSPosedLazyHooks;
 
 import java.io.Serializable;
 
@@ -143,12 +144,18 @@ abstract public class XCallback {
         if (param.callbacks == null)
             throw new IllegalStateException("This object was not created for use with callAll");
 
-        for (int i = 0; i < param.callbacks.length; i++) {
-            try {
-                param.callbacks[i].call(param);
-            } catch (Throwable t) {
-                XposedBridge.log(t);
+        // classes hooked when defined are looked up together once all callbacks are done
+        LSPosedLazyHooks.beginBatch();
+        try {
+            for (int i = 0; i < param.callbacks.length; i++) {
+                try {
+                    param.callbacks[i].call(param);
+                } catch (Throwable t) {
+                    XposedBridge.log(t);
+                }
             }
+        } finally {
+            LSPosedLazyHooks.endBatch();
         }
     }
 
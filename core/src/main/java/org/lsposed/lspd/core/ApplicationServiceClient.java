@@ -26,6 +26,8 @@ import android.os.RemoteException;
 import androidx.annotation.NonNull;
 
 import org.lsposed.lspd.models.Module;
+import org.lsposed.lspd.nativebridge.HookBridge;
+import org.lsposed.lspd.service.IHookProfiler;
 import org.lsposed.lspd.service.ILSPApplicationService;
 import org.lsposed.lspd.util.Utils;
 
@@ -39,6 +41,19 @@ public class ApplicationServiceClient implements ILSPApplicationService, IBinder
 
     final String processName;
 
+    // lets the daemon switch hook install profiling and pull the records
+    private static final IHookProfiler hookProfiler = new IHookProfiler.Stub() {
+        @Override
+        public void setEnabled(boolean enabled) {
+            HookBridge.setInstallProfiling(enabled);
+        }
+
+        @Override
+        public String[] drain() {
+            return HookBridge.drainInstallProfile();
+        }
+    };
+
     private ApplicationServiceClient(@NonNull ILSPApplicationService service, @NonNull String processName) throws RemoteException {
         this.service = service;
         this.processName = processName;
@@ -50,6 +65,7 @@ public class ApplicationServiceClient implements ILSPApplicationService, IBinder
         if (serviceClient == null && binder != null) {
             try {
                 serviceClient = new ApplicationServiceClient(service, niceName);
+                HookBridge.setInstallProfiling(serviceClient.registerHookProfiler(hookProfiler));
             } catch (RemoteException e) {
                 Utils.logE("link to death error: ", e);
             }
@@ -101,6 +117,24 @@ public class ApplicationServiceClient implements ILSPApplicationService, IBinder
         return null;
     }
 
+    @Override
+    public boolean registerHookProfiler(IHookProfiler profiler) {
+        try {
+            return service.registerHookProfiler(profiler);
+        } catch (RemoteException | NullPointerException ignored) {
+        }
+        return false;
+    }
+
+    @Override
+    public ParcelFileDescriptor requestDummyDex(String resourceSuperClass, String typedArraySuperClass) {
+        try {
+            return service.requestDummyDex(resourceSuperClass, typedArraySuperClass);
+        } catch (RemoteException | NullPointerException ignored) {
+        }
+        return null;
+    }
+
     @Override
     public IBinder asBinder() {
         return service.asBinder();
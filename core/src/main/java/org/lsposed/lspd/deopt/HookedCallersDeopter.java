@@ -0,0 +1,114 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+package org.lsposed.lspd.deopt;
+
+import org.lsposed.lspd.nativebridge.DexParserBridge;
+import org.lsposed.lspd.nativebridge.HookBridge;
+import org.lsposed.lspd.util.Hookers;
+
+import java.io.IOException;
+import java.lang.reflect.Executable;
+import java.lang.reflect.Method;
+import java.nio.ByteBuffer;
+import java.nio.channels.Channels;
+import java.util.regex.Pattern;
+import java.util.zip.ZipEntry;
+import java.util.zip.ZipFile;
+
+/**
+ * Deoptimizes the methods of an apk that directly invoke a hooked method, as the compiler may
+ * have inlined the callee into them.
+ */
+public class HookedCallersDeopter {
+    private static final Pattern DEX_ENTRY = Pattern.compile("classes\\d*\\.dex");
+
+    private static String descriptor(Class<?> type) {
+        if (type.isPrimitive()) {
+            if (type == int.class) return "I";
+            if (type == long.class) return "J";
+            if (type == boolean.class) return "Z";
+            if (type == float.class) return "F";
+            if (type == double.class) return "D";
+            if (type == byte.class) return "B";
+            if (type == char.class) return "C";
+            if (type == short.class) return "S";
+            return "V";
+        }
+        if (type.isArray()) return type.getName().replace('.', '/');
+        return "L" + type.getName().replace('.', '/') + ";";
+    }
+
+    // name(params)ret, the class is matched natively as calls may name a subclass or interface
+    private static String signature(Executable method) {
+        var sb = new StringBuilder(method instanceof Method ? method.getName() : "<init>").append('(');
+        for (var type : method.getParameterTypes()) {
+            sb.append(descriptor(type));
+        }
+        sb.append(')');
+        sb.append(method instanceof Method ? descriptor(((Method) method).getReturnType()) : "V");
+        return sb.toString();
+    }
+
+    // streams the entry into a direct buffer holding exactly its bytes
+    private static ByteBuffer read(ZipFile apk, ZipEntry entry) throws IOException {
+        long size = entry.getSize();
+        var dex = ByteBuffer.allocateDirect(size >= 0 ? (int) size : 1 << 20);
+        try (var in = Channels.newChannel(apk.getInputStream(entry))) {
+            while (in.read(dex) >= 0) {
+                if (dex.hasRemaining()) continue;
+                if (size >= 0) break;
+                // the size is unknown, double the buffer until the entry fits
+                var grown = ByteBuffer.allocateDirect(dex.capacity() * 2);
+                dex.flip();
+                grown.put(dex);
+                dex = grown;
+            }
+        }
+        dex.flip();
+        return dex.slice();
+    }
+
+    /**
+     * @return the number of deoptimized callers
+     */
+    public static int deoptCallers(ClassLoader classLoader, String... apkPaths) {
+        var hooked = HookBridge.getHookedMethods();
+        if (hooked.length == 0) return 0;
+        var signatures = new String[hooked.length];
+        for (int i = 0; i < hooked.length; ++i) {
+            signatures[i] = signature(hooked[i]);
+        }
+        int deoptimized = 0;
+        for (var apkPath : apkPaths) {
+            try (var apk = new ZipFile(apkPath)) {
+                for (var entries = apk.entries(); entries.hasMoreElements(); ) {
+                    var entry = entries.nextElement();
+                    if (!DEX_ENTRY.matcher(entry.getName()).matches()) continue;
+                    var dex = read(apk, entry);
+                    deoptimized += DexParserBridge.deoptimizeCallers(dex, classLoader, hooked, signatures);
+                }
+            } catch (Throwable t) {
+                Hookers.logE("error when deopting callers in " + apkPath, t);
+            }
+        }
+        Hookers.logD("deoptimized " + deoptimized + " callers of " + hooked.length + " hooked methods");
+        return deoptimized;
+    }
+}
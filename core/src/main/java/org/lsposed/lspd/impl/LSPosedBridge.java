@@ -9,6 +9,7 @@ import java.lang.reflect.Executable;
 import java.lang.reflect.InvocationTargetException;
 import java.lang.reflect.Method;
 import java.lang.reflect.Modifier;
+import java.util.Arrays;
 
 import de.robv.android.xposed.XposedBridge;
 import io.github.libxposed.api.XposedInterface;
@@ -62,33 +63,56 @@ public class LSPosedBridge {
     }
 
     public static class NativeHooker<T extends Executable> {
-        private final Object params;
+        private final T method;
+        private final Class<?> returnType;
+        private final boolean isStatic;
 
         private NativeHooker(Executable method) {
-            var isStatic = Modifier.isStatic(method.getModifiers());
-            Object returnType;
+            //noinspection unchecked
+            this.method = (T) method;
+            this.isStatic = Modifier.isStatic(method.getModifiers());
             if (method instanceof Method) {
-                returnType = ((Method) method).getReturnType();
+                this.returnType = ((Method) method).getReturnType();
             } else {
-                returnType = null;
+                this.returnType = null;
             }
-            params = new Object[]{
-                    method,
-                    returnType,
-                    isStatic,
-            };
         }
 
         // This method is quite critical. We should try not to use system methods to avoid
         // endless recursive
         public Object callback(Object[] args) throws Throwable {
-            LSPosedHookCallback<T> callback = new LSPosedHookCallback<>();
+            // callbacks whose guard fails are already left out
+            Object[] frame = HookBridge.callbackSnapshot(HookerCallback.class, method, args);
+            if (frame == null || frame.length == 2) {
+                // unhooked while this call was on its way in, or nobody looks at the arguments:
+                // hand them to the backup as they are
+                return HookBridge.invokeOriginalRaw(method, args);
+            }
+            Object[] modernSnapshot = (Object[]) frame[0];
+            Object[] legacySnapshot = (Object[]) frame[1];
+            var recycler = (FrameRecycler) frame[2];
+            if (recycler == null) {
+                frame[2] = recycler = new FrameRecycler();
+            }
 
-            var array = ((Object[]) params);
+            try {
+                return dispatch(modernSnapshot, legacySnapshot, args, recycler);
+            } finally {
+                recycler.recycle(modernSnapshot, legacySnapshot);
+                HookBridge.releaseFrame();
+            }
+        }
 
-            var method = (T) array[0];
-            var returnType = (Class<?>) array[1];
-            var isStatic = (Boolean) array[2];
+        private Object dispatch(Object[] modernSnapshot, Object[] legacySnapshot, Object[] args, FrameRecycler recycler) throws Throwable {
+            // hookers may keep the callback and its arguments past the call, so the frame's own
+            // objects are only used when no hooker gets to see them
+            boolean exposed = legacySnapshot.length != 0;
+            for (var snapshot : modernSnapshot) {
+                var hooker = (HookerCallback) snapshot;
+                exposed |= hooker.beforeParams != 0 || hooker.afterParams != 0;
+            }
+            //noinspection unchecked
+            LSPosedHookCallback<T> callback = exposed ? new LSPosedHookCallback<>() : (LSPosedHookCallback<T>) recycler.callback;
 
             callback.method = method;
 
@@ -97,26 +121,14 @@ public class LSPosedBridge {
                 callback.args = args;
             } else {
                 callback.thisObject = args[0];
-                callback.args = new Object[args.length - 1];
+                callback.args = exposed ? new Object[args.length - 1] : recycler.args(args.length - 1);
                 //noinspection ManualArrayCopy
                 for (int i = 0; i < args.length - 1; ++i) {
                     callback.args[i] = args[i + 1];
                 }
             }
 
-            Object[][] callbacksSnapshot = HookBridge.callbackSnapshot(HookerCallback.class, method);
-            Object[] modernSnapshot = callbacksSnapshot[0];
-            Object[] legacySnapshot = callbacksSnapshot[1];
-
-            if (modernSnapshot.length == 0 && legacySnapshot.length == 0) {
-                try {
-                    return HookBridge.invokeOriginalMethod(method, callback.thisObject, callback.args);
-                } catch (InvocationTargetException ite) {
-                    throw (Throwable) HookBridge.invokeOriginalMethod(getCause, ite);
-                }
-            }
-
-            Object[] ctxArray = new Object[modernSnapshot.length];
+            Object[] ctxArray = recycler.ctx(modernSnapshot.length);
             XposedBridge.LegacyApiSupport<T> legacy = null;
 
             // call "before method" callbacks
@@ -154,7 +166,8 @@ public class LSPosedBridge {
             // call original method if not requested otherwise
             if (!callback.isSkipped) {
                 try {
-                    var result = HookBridge.invokeOriginalMethod(method, callback.thisObject, callback.args);
+                    // native callbacks of the method run around the original in here
+                    var result = HookBridge.invokeHookedOriginal(method, callback.thisObject, callback.args);
                     callback.setResult(result);
                 } catch (InvocationTargetException e) {
                     var throwable = (Throwable) HookBridge.invokeOriginalMethod(getCause, e);
@@ -205,6 +218,50 @@ public class LSPosedBridge {
         }
     }
 
+    /**
+     * Objects of one native dispatch frame that NativeHooker reuses instead of allocating them
+     * again for every hooked call. A frame belongs to one thread and nesting depth; its callback
+     * and arguments are only used for calls whose hookers never see them, everything handed to a
+     * hooker is its own to keep.
+     */
+    static final class FrameRecycler {
+        private static final Object[] EMPTY = new Object[0];
+
+        final LSPosedHookCallback<?> callback = new LSPosedHookCallback<>();
+        private Object[] args = EMPTY;
+        private Object[] ctx = EMPTY;
+        private int ctxUsed;
+
+        Object[] args(int length) {
+            if (args.length != length) {
+                args = new Object[length];
+            }
+            return args;
+        }
+
+        Object[] ctx(int length) {
+            if (ctx.length < length) {
+                ctx = new Object[length];
+            }
+            ctxUsed = length;
+            return ctx;
+        }
+
+        // drops everything the call referenced so that the frame does not keep it alive
+        void recycle(Object[] modernSnapshot, Object[] legacySnapshot) {
+            Arrays.fill(args, null);
+            Arrays.fill(ctx, 0, ctxUsed, null);
+            Arrays.fill(modernSnapshot, null);
+            Arrays.fill(legacySnapshot, null);
+            callback.method = null;
+            callback.thisObject = null;
+            callback.args = null;
+            callback.result = null;
+            callback.throwable = null;
+            callback.isSkipped = false;
+        }
+    }
+
     public static void dummyCallback() {
     }
 
@@ -279,7 +336,7 @@ public class LSPosedBridge {
         }
 
         var callback = new LSPosedBridge.HookerCallback(beforeInvocation, afterInvocation);
-        if (HookBridge.hookMethod(true, hookMethod, LSPosedBridge.NativeHooker.class, priority, callback)) {
+        if (HookBridge.hookMethod(true, hookMethod, LSPosedBridge.NativeHooker.class, priority, callback, null)) {
             return new XposedInterface.MethodUnhooker<>() {
                 @NonNull
                 @Override
@@ -0,0 +1,163 @@
+package org.lsposed.lspd.impl;
+
+import org.lsposed.lspd.nativebridge.HookBridge;
+
+import java.lang.ref.WeakReference;
+import java.util.ArrayList;
+import java.util.HashMap;
+import java.util.Iterator;
+import java.util.List;
+import java.util.Map;
+
+import de.robv.android.xposed.XposedBridge;
+import de.robv.android.xposed.XposedHelpers;
+
+/**
+ * Hooks that are installed once their class gets defined instead of loading it right away.
+ * The native side watches the class-prepare callback of ART for the registered class names and
+ * calls {@link #onClassDefined} with every matching class. Boot classes are not defined by the
+ * watched loaders, they are hooked right away.
+ *
+ * <p>Whether a class was defined before it was registered is looked up for a whole batch of
+ * registrations at once, as that lookup suspends all threads. Module callbacks run in a batch.
+ */
+public class LSPosedLazyHooks {
+    private static final class PendingHook {
+        final String className;
+        final WeakReference<ClassLoader> classLoader;
+        final String methodName; // null for constructors
+        final Object[] parameterTypesAndCallback;
+
+        PendingHook(String className, ClassLoader classLoader, String methodName, Object[] parameterTypesAndCallback) {
+            this.className = className;
+            this.classLoader = new WeakReference<>(classLoader);
+            this.methodName = methodName;
+            this.parameterTypesAndCallback = parameterTypesAndCallback;
+        }
+
+        boolean matches(Class<?> clazz) {
+            var loader = classLoader.get();
+            for (var defining = clazz.getClassLoader(); loader != null; loader = loader.getParent()) {
+                if (loader == defining) return true;
+            }
+            return false;
+        }
+
+        void install(Class<?> clazz) {
+            try {
+                if (methodName == null) {
+                    XposedHelpers.findAndHookConstructor(clazz, parameterTypesAndCallback);
+                } else {
+                    XposedHelpers.findAndHookMethod(clazz, methodName, parameterTypesAndCallback);
+                }
+            } catch (Throwable t) {
+                XposedBridge.log(t);
+            }
+        }
+    }
+
+    private static final Map<String, List<PendingHook>> pendingHooks = new HashMap<>();
+    // registered hooks whose class may have been defined before, not looked up yet
+    private static final List<PendingHook> uncheckedHooks = new ArrayList<>();
+    private static final ThreadLocal<int[]> batchDepth = ThreadLocal.withInitial(() -> new int[1]);
+
+    public static void hookWhenDefined(String className, ClassLoader classLoader, String methodName, Object[] parameterTypesAndCallback) {
+        var hook = new PendingHook(className, classLoader, methodName, parameterTypesAndCallback);
+        try {
+            hook.install(Class.forName(className, false, null));
+            return;
+        } catch (ClassNotFoundException ignored) {
+            // not a boot class, so it comes from a dex file of classLoader or one of its parents
+        }
+        if (!HookBridge.watchClass(className)) {
+            try {
+                hook.install(Class.forName(className, false, classLoader));
+            } catch (ClassNotFoundException e) {
+                XposedBridge.log(e);
+            }
+            return;
+        }
+        synchronized (pendingHooks) {
+            var hooks = pendingHooks.get(className);
+            if (hooks == null) {
+                hooks = new ArrayList<>();
+                pendingHooks.put(className, hooks);
+            }
+            hooks.add(hook);
+            uncheckedHooks.add(hook);
+        }
+        if (batchDepth.get()[0] == 0) checkDefined();
+    }
+
+    /**
+     * Defers looking up whether the classes registered on this thread are defined already until
+     * the matching {@link #endBatch}.
+     */
+    public static void beginBatch() {
+        batchDepth.get()[0]++;
+    }
+
+    public static void endBatch() {
+        if (--batchDepth.get()[0] == 0) checkDefined();
+    }
+
+    // The classes may have been defined before the watch was in place
+    private static void checkDefined() {
+        var loaders = new ArrayList<ClassLoader>();
+        var names = new ArrayList<String>();
+        synchronized (pendingHooks) {
+            for (var hook : uncheckedHooks) {
+                var loader = hook.classLoader.get();
+                if (loader == null) continue;
+                loaders.add(loader);
+                names.add(hook.className);
+            }
+            uncheckedHooks.clear();
+        }
+        if (names.isEmpty()) return;
+        var defined = HookBridge.findDefinedClasses(loaders.toArray(new ClassLoader[0]), names.toArray(new String[0]));
+        for (int i = 0; i < defined.length; i++) {
+            if (!defined[i]) continue;
+            try {
+                // defined already, so this does not define anything
+                onClassDefined(Class.forName(names.get(i), false, loaders.get(i)));
+            } catch (ClassNotFoundException e) {
+                XposedBridge.log(e);
+            }
+        }
+    }
+
+    // Called natively right after a watched class is defined, from within ART, so nothing may
+    // escape from here
+    static void onClassDefined(Class<?> clazz) {
+        try {
+            installPending(clazz);
+        } catch (Throwable t) {
+            XposedBridge.log(t);
+        }
+    }
+
+    private static void installPending(Class<?> clazz) {
+        var ready = new ArrayList<PendingHook>();
+        synchronized (pendingHooks) {
+            var hooks = pendingHooks.get(clazz.getName());
+            if (hooks == null) return;
+            for (Iterator<PendingHook> it = hooks.iterator(); it.hasNext(); ) {
+                var hook = it.next();
+                if (hook.classLoader.get() == null) {
+                    it.remove();
+                } else if (hook.matches(clazz)) {
+                    ready.add(hook);
+                    it.remove();
+                }
+            }
+            if (hooks.isEmpty()) {
+                pendingHooks.remove(clazz.getName());
+                HookBridge.unwatchClass(clazz.getName());
+            }
+        }
+        for (var hook : ready) {
+            hook.install(clazz);
+        }
+    }
+}
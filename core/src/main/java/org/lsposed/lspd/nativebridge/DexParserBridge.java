@@ -1,6 +1,7 @@
 package org.lsposed.lspd.nativebridge;
 
 import java.io.IOException;
+import java.lang.reflect.Executable;
 import java.lang.reflect.Method;
 import java.nio.ByteBuffer;
 
@@ -14,6 +15,8 @@ public class DexParserBridge {
     @FastNative
     public static native void closeDex(long cookie);
 
+    public static native int deoptimizeCallers(ByteBuffer data, ClassLoader classLoader, Executable[] targets, String[] signatures) throws IOException;
+
     @FastNative
     public static native void visitClass(long cookie, Object visitor, Class<DexParser.FieldVisitor> fieldVisitorClass, Class<DexParser.MethodVisitor> methodVisitorClass, Method classVisitMethod, Method fieldVisitMethod, Method methodVisitMethod, Method methodBodyVisitMethod, Method stopMethod);
 }
@@ -6,16 +6,22 @@ import java.lang.reflect.InvocationTargetException;
 import dalvik.annotation.optimization.FastNative;
 
 public class HookBridge {
-    public static native boolean hookMethod(boolean useModernApi, Executable hookMethod, Class<?> hooker, int priority, Object callback);
+    public static native boolean hookMethod(boolean useModernApi, Executable hookMethod, Class<?> hooker, int priority, Object callback, Object guard);
 
     public static native boolean unhookMethod(boolean useModernApi, Executable hookMethod, Object callback);
 
+    public static native boolean isHooked(boolean useModernApi, Executable hookMethod, Object callback);
+
     public static native boolean deoptimizeMethod(Executable method);
 
     public static native <T> T allocateObject(Class<T> clazz) throws InstantiationException;
 
     public static native Object invokeOriginalMethod(Executable method, Object thisObject, Object... args) throws IllegalAccessException, IllegalArgumentException, InvocationTargetException;
 
+    public static native Object invokeOriginalRaw(Executable method, Object[] args) throws Throwable;
+
+    public static native Object invokeHookedOriginal(Executable method, Object thisObject, Object[] args) throws IllegalAccessException, IllegalArgumentException, InvocationTargetException;
+
     public static native <T> Object invokeSpecialMethod(Executable method, char[] shorty, Class<T> clazz, Object thisObject, Object... args) throws IllegalAccessException, IllegalArgumentException, InvocationTargetException;
 
     @FastNative
@@ -24,5 +30,34 @@ public class HookBridge {
     @FastNative
     public static native boolean setTrusted(Object cookie);
 
-    public static native Object[][] callbackSnapshot(Class<?> hooker_callback, Executable method);
+    public static native Object[] callbackSnapshot(Class<?> hooker_callback, Executable method, Object[] args);
+
+    @FastNative
+    public static native void releaseFrame();
+
+    /**
+     * @return the number of dispatch frames allocated and reused so far
+     */
+    public static native long[] getFrameStats();
+
+    public static native void setInstallProfiling(boolean enabled);
+
+    /**
+     * @return the phase timings of the hooks installed since the last call, oldest first
+     */
+    public static native String[] drainInstallProfile();
+
+    public static native Executable[] getHookedMethods();
+
+    /**
+     * @return whether class definitions can be watched on this device
+     */
+    public static native boolean watchClass(String className);
+
+    /**
+     * @return for each class, whether its loader or one of their parents has defined it already
+     */
+    public static native boolean[] findDefinedClasses(ClassLoader[] classLoaders, String[] classNames);
+
+    public static native void unwatchClass(String className);
 }
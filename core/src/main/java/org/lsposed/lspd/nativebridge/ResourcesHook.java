@@ -34,5 +34,13 @@ public class ResourcesHook {
     public static native ClassLoader buildDummyClassLoader(ClassLoader parent, String resourceSuperClass, String typedArraySuperClass);
 
     @FastNative
-    public static native void rewriteXmlReferencesNative(long parserPtr, XResources origRes, Resources repRes);
+    public static native void rewriteXmlReferencesNative(long parserPtr, long translationKey, int xmlId, XResources origRes, Resources repRes);
+
+    @FastNative
+    public static native void invalidateTranslations();
+
+    /**
+     * @return how often rewriting an XML could apply the recorded patches, and how often not
+     */
+    public static native long[] getXmlPatchStats();
 }
@@ -0,0 +1,67 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+#pragma once
+
+#include <atomic>
+#include <mutex>
+#include <utility>
+
+namespace lspd {
+
+// A value that is never modified once published. Writers copy it and swap the pointer, so
+// readers load it without taking a lock and keep a consistent snapshot for as long as they like.
+//
+// Superseded snapshots are kept until the CopyOnWrite itself is destroyed: a reader may hold one
+// for an unbounded time, e.g. across a callback that reenters. Only use it for state that changes
+// a bounded number of times.
+template<typename T>
+class CopyOnWrite {
+    struct Snapshot {
+        T value;
+        const Snapshot *previous;
+    };
+
+public:
+    CopyOnWrite() = default;
+    CopyOnWrite(const CopyOnWrite &) = delete;
+    CopyOnWrite &operator=(const CopyOnWrite &) = delete;
+
+    ~CopyOnWrite() {
+        for (auto *s = current_.load(std::memory_order_relaxed); s;) delete std::exchange(s, s->previous);
+    }
+
+    const T &Load() const { return current_.load(std::memory_order_acquire)->value; }
+
+    // Updates are serialized, each one sees the result of the previous
+    template<typename Modify>
+    void Update(Modify &&modify) {
+        std::lock_guard lk(lock_);
+        const auto *current = current_.load(std::memory_order_relaxed);
+        auto *next = new Snapshot{current->value, current};
+        modify(next->value);
+        current_.store(next, std::memory_order_release);
+    }
+
+private:
+    std::mutex lock_;
+    std::atomic<const Snapshot *> current_{new Snapshot{T{}, nullptr}};
+};
+
+}  // namespace lspd
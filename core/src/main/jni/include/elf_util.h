@@ -20,6 +20,7 @@
 #ifndef SANDHOOK_ELF_UTIL_H
 #define SANDHOOK_ELF_UTIL_H
 
+#include <array>
 #include <string_view>
 #include <map>
 #include <linux/elf.h>
@@ -47,6 +48,17 @@ namespace SandHook {
             }
         }
 
+        // Resolves all names in one go, missing ones are left null
+        template<size_t N, typename T = void*>
+        requires(std::is_pointer_v<T>)
+        std::array<T, N> getSymbAddresses(const std::array<std::string_view, N> &names) const {
+            std::array<T, N> res{};
+            for (size_t i = 0; i < N; ++i) {
+                res[i] = getSymbAddress<T>(names[i]);
+            }
+            return res;
+        }
+
         template<typename T = void*>
         requires(std::is_pointer_v<T>)
         constexpr const T getSymbPrefixFirstAddress(std::string_view prefix) const {
@@ -70,6 +82,9 @@ namespace SandHook {
             return res;
         }
 
+        // name of the symtab symbol covering addr, empty if there is none
+        std::string_view getSymbName(const void *addr) const;
+
         bool isValid() const {
             return base != nullptr;
         }
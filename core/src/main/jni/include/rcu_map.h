@@ -0,0 +1,224 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace lspd {
+
+// Epoch based grace periods for RcuMap. Readers publish the epoch they started in, writers wait
+// until no reader of an older epoch is left before freeing what they unlinked.
+class RcuDomain {
+    struct alignas(64) Record {
+        std::atomic<uint64_t> active{0};
+        std::atomic<bool> in_use{true};
+        Record *next = nullptr;
+    };
+
+    std::atomic<uint64_t> epoch_{1};
+    std::atomic<Record *> records_{nullptr};
+
+    Record *AcquireRecord() {
+        for (auto *r = records_.load(std::memory_order_acquire); r; r = r->next) {
+            bool free = false;
+            if (r->in_use.compare_exchange_strong(free, true, std::memory_order_acq_rel)) return r;
+        }
+        // records are never freed, a thread that exits hands its record to the next one
+        auto *r = new Record;
+        r->next = records_.load(std::memory_order_relaxed);
+        while (!records_.compare_exchange_weak(r->next, r, std::memory_order_acq_rel)) {}
+        return r;
+    }
+
+    Record &ThreadRecord() {
+        thread_local struct Holder {
+            Record *record;
+            ~Holder() { record->in_use.store(false, std::memory_order_release); }
+        } holder{Instance().AcquireRecord()};
+        return *holder.record;
+    }
+
+public:
+    static RcuDomain &Instance() {
+        static RcuDomain domain;
+        return domain;
+    }
+
+    class ReadGuard {
+        Record &record_;
+    public:
+        explicit ReadGuard(Record &record, uint64_t epoch) : record_(record) {
+            record_.active.store(epoch, std::memory_order_seq_cst);
+        }
+        ~ReadGuard() { record_.active.store(0, std::memory_order_release); }
+        ReadGuard(const ReadGuard &) = delete;
+        ReadGuard &operator=(const ReadGuard &) = delete;
+    };
+
+    // Read sections must be short and must not nest
+    ReadGuard Read() {
+        return ReadGuard(ThreadRecord(), epoch_.load(std::memory_order_seq_cst));
+    }
+
+    // Returns once every read section that could still see unlinked data has ended
+    void Synchronize() {
+        auto target = epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+        for (auto *r = records_.load(std::memory_order_acquire); r; r = r->next) {
+            for (uint64_t e; (e = r->active.load(std::memory_order_seq_cst)) != 0 && e < target;) {
+                std::this_thread::yield();
+            }
+        }
+    }
+};
+
+// Open addressing map from a pointer-like key to shared_ptr<V>, tuned for rare writes and
+// frequent concurrent reads. Lookups are wait-free apart from copying the shared_ptr; writes
+// are serialized by a mutex. A zero key is reserved as the empty marker.
+template<typename K, typename V>
+class RcuMap {
+    using Value = std::shared_ptr<V>;
+
+    struct Slot {
+        std::atomic<K> key{};
+        std::atomic<Value *> value{nullptr};
+    };
+
+    struct Table {
+        explicit Table(size_t capacity) : mask(capacity - 1), slots(capacity) {}
+        const size_t mask;
+        std::vector<Slot> slots;
+        size_t used = 0;     // slots with a key, removed entries keep theirs
+        size_t live = 0;
+    };
+
+    static size_t Hash(K key) {
+        auto h = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key));
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return static_cast<size_t>(h);
+    }
+
+    static Slot *Probe(Table *table, K key) {
+        for (size_t i = Hash(key) & table->mask;; i = (i + 1) & table->mask) {
+            auto &slot = table->slots[i];
+            auto k = slot.key.load(std::memory_order_acquire);
+            if (k == key || k == K{}) return &slot;
+        }
+    }
+
+    std::atomic<Table *> table_;
+    std::mutex write_lock_;
+
+    // Called with write_lock_ held before adding a key
+    void Reserve() {
+        auto *table = table_.load(std::memory_order_relaxed);
+        if ((table->used + 1) * 2 <= table->slots.size()) return;
+        auto capacity = std::bit_ceil(std::max<size_t>((table->live + 1) * 4, 16));
+        auto *grown = new Table(capacity);
+        for (auto &slot : table->slots) {
+            auto *value = slot.value.load(std::memory_order_relaxed);
+            if (!value) continue;
+            auto *to = Probe(grown, slot.key.load(std::memory_order_relaxed));
+            to->value.store(value, std::memory_order_relaxed);
+            to->key.store(slot.key.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            ++grown->used;
+            ++grown->live;
+        }
+        table_.store(grown, std::memory_order_release);
+        RcuDomain::Instance().Synchronize();
+        delete table;
+    }
+
+public:
+    RcuMap() : table_(new Table(16)) {}
+
+    ~RcuMap() {
+        auto *table = table_.load(std::memory_order_relaxed);
+        for (auto &slot : table->slots) delete slot.value.load(std::memory_order_relaxed);
+        delete table;
+    }
+
+    Value Find(K key) {
+        auto guard = RcuDomain::Instance().Read();
+        auto *slot = Probe(table_.load(std::memory_order_acquire), key);
+        // the probe may end on an empty slot that a writer is just filling with another key
+        if (slot->key.load(std::memory_order_acquire) != key) return nullptr;
+        auto *value = slot->value.load(std::memory_order_acquire);
+        return value ? *value : nullptr;
+    }
+
+    // Returns the value of key, creating it with make() if there is none
+    template<typename Make>
+    std::pair<Value, bool> FindOrInsert(K key, Make &&make) {
+        if (auto value = Find(key)) return {std::move(value), false};
+        std::lock_guard lk(write_lock_);
+        auto *slot = Probe(table_.load(std::memory_order_relaxed), key);
+        if (auto *value = slot->value.load(std::memory_order_relaxed)) return {*value, false};
+        if (slot->key.load(std::memory_order_relaxed) == K{}) {
+            Reserve();
+            auto *table = table_.load(std::memory_order_relaxed);
+            slot = Probe(table, key);
+            ++table->used;
+        }
+        auto *value = new Value(make());
+        // publish the value before the key so that readers finding the key see it
+        slot->value.store(value, std::memory_order_release);
+        slot->key.store(key, std::memory_order_release);
+        ++table_.load(std::memory_order_relaxed)->live;
+        return {*value, true};
+    }
+
+    // Calls visit(key, value) for every entry, with writers blocked
+    template<typename Visit>
+    void ForEach(Visit &&visit) {
+        std::lock_guard lk(write_lock_);
+        for (auto &slot : table_.load(std::memory_order_relaxed)->slots) {
+            if (auto *value = slot.value.load(std::memory_order_relaxed)) {
+                visit(slot.key.load(std::memory_order_relaxed), *value);
+            }
+        }
+    }
+
+    // Removes key if it still maps to expected
+    bool EraseIf(K key, const V *expected) {
+        Value *old;
+        {
+            std::lock_guard lk(write_lock_);
+            auto *table = table_.load(std::memory_order_relaxed);
+            auto *slot = Probe(table, key);
+            old = slot->value.load(std::memory_order_relaxed);
+            if (!old || old->get() != expected) return false;
+            slot->value.store(nullptr, std::memory_order_release);
+            --table->live;
+        }
+        RcuDomain::Instance().Synchronize();
+        delete old;
+        return true;
+    }
+};
+
+}  // namespace lspd
@@ -26,6 +26,7 @@
 #define LSPOSED_SYMBOL_CACHE_H
 
 #include <memory>
+#include <string_view>
 
 namespace SandHook {
     class ElfImg;
@@ -34,7 +35,11 @@ namespace SandHook {
 namespace lspd {
     std::unique_ptr<const SandHook::ElfImg> &GetArt(bool release=false);
     std::unique_ptr<const SandHook::ElfImg> &GetLibBinder(bool release=false);
+    std::unique_ptr<const SandHook::ElfImg> &GetLibFw(bool release=false);
     std::unique_ptr<const SandHook::ElfImg> &GetLinker(bool release=false);
+    // any loaded library, null if not loaded; callers serialize their lookups and keep the image
+    // no longer than until the next call, which may drop it
+    const SandHook::ElfImg *GetElfImg(std::string_view name);
 }
 
 #endif //LSPOSED_SYMBOL_CACHE_H
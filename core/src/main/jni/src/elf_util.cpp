@@ -344,6 +344,17 @@ ElfW(Addr) ElfImg::PrefixLookupFirst(std::string_view prefix) const {
     }
 }
 
+std::string_view ElfImg::getSymbName(const void *addr) const {
+    if (base == nullptr) return {};
+    auto offset = static_cast<ElfW(Addr)>(reinterpret_cast<uintptr_t>(addr) -
+                                          reinterpret_cast<uintptr_t>(base) + bias);
+    MayInitLinearMap();
+    for (const auto &[name, sym] : symtabs_) {
+        if (offset >= sym->st_value && offset < sym->st_value + sym->st_size) return name;
+    }
+    return {};
+}
+
 ElfImg::~ElfImg() {
     // open elf file local
     if (buffer) {
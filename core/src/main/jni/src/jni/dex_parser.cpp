@@ -18,9 +18,12 @@
  */
 
 #include "dex_parser.h"
+#include "hook_bridge.h"
 #include "native_util.h"
+#include "lsplant.hpp"
 #include "slicer/reader.h"
 
+#include <algorithm>
 #include <list>
 #include <set>
 #include <parallel_hashmap/phmap.h>
@@ -34,6 +37,69 @@ namespace {
     using Annotation = std::tuple<jint/*vis*/, jint /*type*/, ElementList>;
     using AnnotationList = std::vector<Annotation>;
 
+    constexpr dex::u1 kOpcodeMask = 0xff;
+    constexpr dex::u1 kOpcodeNoOp = 0x00;
+    constexpr dex::u1 kOpcodeInvokeStart = 0x6e;
+    constexpr dex::u1 kOpcodeInvokeEnd = 0x72;
+    constexpr dex::u1 kOpcodeInvokeRangeStart = 0x74;
+    constexpr dex::u1 kOpcodeInvokeRangeEnd = 0x78;
+    constexpr dex::u2 kInstPackedSwitchPlayLoad = 0x0100;
+    constexpr dex::u2 kInstSparseSwitchPlayLoad = 0x0200;
+    constexpr dex::u2 kInstFillArrayDataPlayLoad = 0x0300;
+
+    constexpr bool IsInvoke(dex::u1 opcode) {
+        return (opcode >= kOpcodeInvokeStart && opcode <= kOpcodeInvokeEnd) ||
+               (opcode >= kOpcodeInvokeRangeStart && opcode <= kOpcodeInvokeRangeEnd);
+    }
+
+    // Calls visit(inst, opcode) for every instruction of code, skipping switch and array payloads
+    template<typename Visitor>
+    void ForEachInstruction(const dex::Code *code, Visitor &&visit) {
+        const dex::u2 *inst = code->insns;
+        const dex::u2 *end = inst + code->insns_size;
+        while (inst < end) {
+            dex::u1 opcode = *inst & kOpcodeMask;
+            visit(inst, opcode);
+            if (opcode == kOpcodeNoOp) {
+                if (*inst == kInstPackedSwitchPlayLoad) {
+                    inst += inst[1] * 2 + 3;
+                } else if (*inst == kInstSparseSwitchPlayLoad) {
+                    inst += inst[1] * 4 + 1;
+                } else if (*inst == kInstFillArrayDataPlayLoad) {
+                    inst += (*reinterpret_cast<const dex::u4 *>(&inst[2]) *
+                             inst[1] + 1) /
+                            2 + 3;
+                }
+            }
+            inst += dex::opcode_len[opcode];
+        }
+    }
+
+    std::string_view GetString(const dex::Reader &dex, dex::u4 string_idx) {
+        const auto *ptr = dex.dataPtr<dex::u1>(dex.StringIds()[string_idx].string_data_off);
+        dex::ReadULeb128(&ptr);
+        return reinterpret_cast<const char *>(ptr);
+    }
+
+    std::string_view GetTypeDescriptor(const dex::Reader &dex, dex::u4 type_idx) {
+        return GetString(dex, dex.TypeIds()[type_idx].descriptor_idx);
+    }
+
+    // (params)ret, which is also what JNI takes as method signature
+    std::string GetProtoSignature(const dex::Reader &dex, dex::u4 proto_idx) {
+        const auto &proto = dex.ProtoIds()[proto_idx];
+        std::string signature = "(";
+        if (proto.parameters_off) {
+            const auto *params = dex.dataPtr<dex::TypeList>(proto.parameters_off);
+            for (size_t i = 0; i < params->size; ++i) {
+                signature += GetTypeDescriptor(dex, params->list[i].type_idx);
+            }
+        }
+        signature += ')';
+        signature += GetTypeDescriptor(dex, proto.return_type_idx);
+        return signature;
+    }
+
     class DexParser : public dex::Reader {
     public:
         DexParser(const dex::u1 *data, size_t size) : dex::Reader(data, size, nullptr, 0) {}
@@ -530,8 +596,6 @@ namespace lspd {
                           jobject method_visit_method,
                           jobject method_body_visit_method,
                           jobject stop_method) {
-        static constexpr dex::u1 kOpcodeMask = 0xff;
-        static constexpr dex::u1 kOpcodeNoOp = 0x00;
         static constexpr dex::u1 kOpcodeConstString = 0x1a;
         static constexpr dex::u1 kOpcodeConstStringJumbo = 0x1b;
         static constexpr dex::u1 kOpcodeIGetStart = 0x52;
@@ -542,13 +606,6 @@ namespace lspd {
         static constexpr dex::u1 kOpcodeIPutEnd = 0x5f;
         static constexpr dex::u1 kOpcodeSPutStart = 0x67;
         static constexpr dex::u1 kOpcodeSPutEnd = 0x6d;
-        static constexpr dex::u1 kOpcodeInvokeStart = 0x6e;
-        static constexpr dex::u1 kOpcodeInvokeEnd = 0x72;
-        static constexpr dex::u1 kOpcodeInvokeRangeStart = 0x74;
-        static constexpr dex::u1 kOpcodeInvokeRangeEnd = 0x78;
-        static constexpr dex::u2 kInstPackedSwitchPlayLoad = 0x0100;
-        static constexpr dex::u2 kInstSparseSwitchPlayLoad = 0x0200;
-        static constexpr dex::u2 kInstFillArrayDataPlayLoad = 0x0300;
 
         if (cookie == 0) {
             return;
@@ -711,10 +768,7 @@ namespace lspd {
                                 std::set<jint> accessed_fields;
                                 std::set<jint> invoked_methods;
 
-                                const dex::u2 *inst = code->insns;
-                                const dex::u2 *end = inst + code->insns_size;
-                                while (inst < end) {
-                                    dex::u1 opcode = *inst & kOpcodeMask;
+                                ForEachInstruction(code, [&](const dex::u2 *inst, dex::u1 opcode) {
                                     body.opcodes.push_back(static_cast<jbyte>(opcode));
                                     if (opcode == kOpcodeConstString) {
                                         auto str_idx = inst[1];
@@ -734,26 +788,11 @@ namespace lspd {
                                         auto field_idx = inst[1];
                                         assigned_fields.emplace(field_idx);
                                     }
-                                    if ((opcode >= kOpcodeInvokeStart &&
-                                         opcode <= kOpcodeInvokeEnd) ||
-                                        (opcode >= kOpcodeInvokeRangeStart &&
-                                         opcode <= kOpcodeInvokeRangeEnd)) {
+                                    if (IsInvoke(opcode)) {
                                         auto callee = inst[1];
                                         invoked_methods.emplace(callee);
                                     }
-                                    if (opcode == kOpcodeNoOp) {
-                                        if (*inst == kInstPackedSwitchPlayLoad) {
-                                            inst += inst[1] * 2 + 3;
-                                        } else if (*inst == kInstSparseSwitchPlayLoad) {
-                                            inst += inst[1] * 4 + 1;
-                                        } else if (*inst == kInstFillArrayDataPlayLoad) {
-                                            inst += (*reinterpret_cast<const dex::u4 *>(&inst[2]) *
-                                                     inst[1] + 1) /
-                                                    2 + 3;
-                                        }
-                                    }
-                                    inst += dex::opcode_len[opcode];
-                                }
+                                });
                                 body.referred_strings.insert(body.referred_strings.end(),
                                                              referred_strings.begin(),
                                                              referred_strings.end());
@@ -808,10 +847,187 @@ namespace lspd {
         }
     }
 
+    LSP_DEF_NATIVE_METHOD(jint, DexParserBridge, deoptimizeCallers, jobject data,
+                          jobject class_loader, jobjectArray targets, jobjectArray signatures) {
+        auto dex_size = env->GetDirectBufferCapacity(data);
+        if (dex_size == -1) {
+            env->ThrowNew(env->FindClass("java/io/IOException"), "Invalid dex data");
+            return 0;
+        }
+        dex::Reader dex(reinterpret_cast<dex::u1 *>(env->GetDirectBufferAddress(data)), dex_size,
+                        nullptr, 0);
+        if (dex.IsCompact()) {
+            env->ThrowNew(env->FindClass("java/io/IOException"), "Compact dex is not supported");
+            return 0;
+        }
+
+        auto load_class = lsplant::JNI_GetMethodID(env, lsplant::JNI_FindClass(env, "java/lang/ClassLoader"),
+                                                   "loadClass", "(Ljava/lang/String;)Ljava/lang/Class;");
+        // Classes the loader has defined already, looked up for a batch of types at once. Classes
+        // that are not defined yet are skipped instead of loaded, which would cost start up time.
+        phmap::flat_hash_set<dex::u4> defined;
+        auto find_defined = [&](const phmap::flat_hash_set<dex::u4> &type_ids) {
+            std::vector<dex::u4> ids;
+            std::vector<std::string> descriptors;
+            for (auto type_idx : type_ids) {
+                auto descriptor = GetTypeDescriptor(dex, type_idx);
+                if (descriptor.size() < 2 || descriptor.front() != 'L') continue;
+                ids.push_back(type_idx);
+                descriptors.emplace_back(descriptor);
+            }
+            auto found = FindDefinedClasses(env, class_loader, descriptors);
+            if (!found) return false;
+            for (size_t i = 0; i < ids.size(); ++i) {
+                if ((*found)[i]) defined.emplace(ids[i]);
+            }
+            return true;
+        };
+        // null for arrays and classes the loader has not defined
+        auto load = [&](dex::u4 type_idx) {
+            if (!defined.contains(type_idx)) return lsplant::ScopedLocalRef<jclass>(env, nullptr);
+            auto descriptor = GetTypeDescriptor(dex, type_idx);
+            // Lpkg/Name; to pkg.Name
+            std::string class_name(descriptor.substr(1, descriptor.size() - 2));
+            std::replace(class_name.begin(), class_name.end(), '/', '.');
+            lsplant::ScopedLocalRef java_name(env, env->NewStringUTF(class_name.c_str()));
+            // defined already, so this does not define anything
+            auto clazz = lsplant::JNI_Cast<jclass>(lsplant::JNI_CallObjectMethod(env, class_loader, load_class, java_name));
+            if (env->ExceptionCheck()) {
+                env->ExceptionClear();
+                clazz.reset();
+            }
+            return clazz;
+        };
+
+        // hooked methods by name(params)ret, as the class a call names may be any class the
+        // call dispatches through
+        struct Target {
+            lsplant::ScopedLocalRef<jclass> clazz;
+            jmethodID id;
+            // static methods and constructors are never dispatched
+            bool direct;
+        };
+        auto executable = lsplant::JNI_FindClass(env, "java/lang/reflect/Executable");
+        auto get_declaring_class = lsplant::JNI_GetMethodID(env, executable, "getDeclaringClass", "()Ljava/lang/Class;");
+        auto get_modifiers = lsplant::JNI_GetMethodID(env, executable, "getModifiers", "()I");
+        phmap::flat_hash_map<std::string, std::vector<Target>> wanted;
+        for (jsize i = 0, len = env->GetArrayLength(targets); i < len; ++i) {
+            lsplant::ScopedLocalRef target(env, env->GetObjectArrayElement(targets, i));
+            lsplant::ScopedLocalRef signature(env, static_cast<jstring>(env->GetObjectArrayElement(signatures, i)));
+            std::string key = lsplant::JUTFString(env, signature.get()).get();
+            auto direct = (env->CallIntMethod(target.get(), get_modifiers) & dex::kAccStatic) != 0 ||
+                          key.starts_with("<init>(");
+            wanted[key].push_back({lsplant::JNI_Cast<jclass>(lsplant::JNI_CallObjectMethod(env, target, get_declaring_class)),
+                                   env->FromReflectedMethod(target.get()), direct});
+        }
+        auto methods = dex.MethodIds();
+        std::vector<dex::u4> candidates;
+        phmap::flat_hash_set<dex::u4> candidate_types;
+        for (dex::u4 i = 0; i < methods.size(); ++i) {
+            auto name = std::string(GetString(dex, methods[i].name_idx));
+            if (!wanted.contains(name + GetProtoSignature(dex, methods[i].proto_idx))) continue;
+            candidates.push_back(i);
+            candidate_types.emplace(methods[i].class_idx);
+        }
+        if (candidates.empty()) return 0;
+        if (!find_defined(candidate_types)) {
+            LOGW("Class tables can not be read, callers are not deoptimized");
+            return 0;
+        }
+        phmap::flat_hash_set<dex::u4> callees;
+        for (auto i : candidates) {
+            auto name = std::string(GetString(dex, methods[i].name_idx));
+            auto signature = GetProtoSignature(dex, methods[i].proto_idx);
+            auto found = wanted.find(name + signature);
+            auto clazz = load(methods[i].class_idx);
+            if (!clazz) continue;
+            for (const auto &target : found->second) {
+                // a virtual call through the class of the target or one of its supertypes may
+                // land on the target; otherwise the call has to resolve to it
+                if (target.direct || !env->IsAssignableFrom(target.clazz.get(), clazz.get())) {
+                    if (!env->IsAssignableFrom(clazz.get(), target.clazz.get())) continue;
+                    auto *id = target.direct && name != "<init>"
+                               ? env->GetStaticMethodID(clazz.get(), name.c_str(), signature.c_str())
+                               : env->GetMethodID(clazz.get(), name.c_str(), signature.c_str());
+                    if (env->ExceptionCheck()) {
+                        env->ExceptionClear();
+                        continue;
+                    }
+                    if (id != target.id) continue;
+                }
+                callees.emplace(i);
+                break;
+            }
+        }
+        if (callees.empty()) return 0;
+
+        struct Caller {
+            dex::u4 class_idx;
+            dex::u4 method_idx;
+            bool is_static;
+        };
+        std::vector<Caller> callers;
+        for (const auto &class_def : dex.ClassDefs()) {
+            if (class_def.class_data_off == 0) continue;
+            const auto *ptr = dex.dataPtr<dex::u1>(class_def.class_data_off);
+            auto static_fields_count = dex::ReadULeb128(&ptr);
+            auto instance_fields_count = dex::ReadULeb128(&ptr);
+            auto direct_methods_count = dex::ReadULeb128(&ptr);
+            auto virtual_methods_count = dex::ReadULeb128(&ptr);
+            for (size_t k = 0; k < 2 * (static_fields_count + instance_fields_count); ++k) {
+                dex::ReadULeb128(&ptr);
+            }
+            for (size_t k = 0, method_idx = 0; k < direct_methods_count + virtual_methods_count; ++k) {
+                // indexes are delta encoded per list
+                if (k == direct_methods_count) method_idx = 0;
+                method_idx += dex::ReadULeb128(&ptr);
+                auto access_flags = dex::ReadULeb128(&ptr);
+                auto code_off = dex::ReadULeb128(&ptr);
+                if (code_off == 0) continue;
+                bool calls_target = false;
+                ForEachInstruction(dex.dataPtr<dex::Code>(code_off), [&](const dex::u2 *inst, dex::u1 opcode) {
+                    calls_target |= IsInvoke(opcode) && callees.contains(inst[1]);
+                });
+                if (calls_target) {
+                    callers.push_back({class_def.class_idx, static_cast<dex::u4>(method_idx),
+                                       (access_flags & dex::kAccStatic) != 0});
+                }
+            }
+        }
+
+        phmap::flat_hash_set<dex::u4> caller_types;
+        for (const auto &caller : callers) caller_types.emplace(caller.class_idx);
+        find_defined(caller_types);
+
+        jint deoptimized = 0;
+        for (const auto &caller : callers) {
+            const auto &method = methods[caller.method_idx];
+            auto name = std::string(GetString(dex, method.name_idx));
+            if (name == "<clinit>") continue;
+            auto clazz = load(caller.class_idx);
+            if (!clazz) continue;
+            auto signature = GetProtoSignature(dex, method.proto_idx);
+            auto *id = caller.is_static
+                       ? env->GetStaticMethodID(clazz.get(), name.c_str(), signature.c_str())
+                       : env->GetMethodID(clazz.get(), name.c_str(), signature.c_str());
+            if (env->ExceptionCheck() || !id) {
+                env->ExceptionClear();
+                continue;
+            }
+            auto reflected = lsplant::JNI_ToReflectedMethod(env, clazz, id, caller.is_static);
+            if (lsplant::Deoptimize(env, reflected.get())) ++deoptimized;
+        }
+        LOGD("Deoptimized {} of {} callers of {} hooked methods", deoptimized, callers.size(),
+             callees.size());
+        return deoptimized;
+    }
+
     static JNINativeMethod gMethods[] = {
             LSP_NATIVE_METHOD(DexParserBridge, openDex,
                               "(Ljava/nio/ByteBuffer;[J)Ljava/lang/Object;"),
             LSP_NATIVE_METHOD(DexParserBridge, closeDex, "(J)V"),
+            LSP_NATIVE_METHOD(DexParserBridge, deoptimizeCallers,
+                              "(Ljava/nio/ByteBuffer;Ljava/lang/ClassLoader;[Ljava/lang/reflect/Executable;[Ljava/lang/String;)I"),
             LSP_NATIVE_METHOD(DexParserBridge, visitClass,
                               "(JLjava/lang/Object;Ljava/lang/Class;Ljava/lang/Class;Ljava/lang/reflect/Method;Ljava/lang/reflect/Method;Ljava/lang/reflect/Method;Ljava/lang/reflect/Method;Ljava/lang/reflect/Method;)V"),
     };
@@ -18,13 +18,24 @@
  */
 
 #include "hook_bridge.h"
+#include "config.h"
+#include "elf_util.h"
 #include "native_util.h"
 #include "lsplant.hpp"
+#include "rcu_map.h"
+#include "symbol_cache.h"
 #include <parallel_hashmap/phmap.h>
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <memory>
 #include <shared_mutex>
 #include <mutex>
+#include <optional>
 #include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 using namespace lsplant;
 
@@ -32,11 +43,171 @@ namespace {
 struct ModuleCallback {
     jmethodID before_method;
     jmethodID after_method;
+    jobject callback = nullptr;  // the HookerCallback, global reference once added
+};
+
+struct NativeCallback {
+    NativeJavaHookCallback before;
+    NativeJavaHookCallback after;
+    void *data;
+};
+
+using NativeCallbacks = std::vector<NativeCallback>;
+
+// Declarative conditions on the arguments of a legacy callback, see XC_MethodHook.Guard
+struct HookGuard {
+    enum Op : jint {
+        kArgNull = 0,
+        kArgNotNull = 1,
+        kArgInstanceOf = 2,
+        kArgEquals = 3,
+    };
+    struct Condition {
+        Op op;
+        jsize index;
+        char shorty;
+        jvalue value;             // kArgEquals on a primitive
+        jclass type = nullptr;    // kArgInstanceOf, global reference
+        std::u16string string;    // kArgEquals on a String
+    };
+    std::vector<Condition> conditions;
+    bool not_reentrant = false;
+
+    void Release(JNIEnv *env) {
+        for (auto &c : conditions) {
+            if (c.type) env->DeleteGlobalRef(c.type);
+        }
+    }
+};
+
+struct LegacyCallback {
+    jobject callback;
+    std::unique_ptr<HookGuard> guard;
 };
 
 struct HookItem {
-    std::multimap<jint, jobject, std::greater<>> legacy_callbacks;
+    std::multimap<jint, LegacyCallback, std::greater<>> legacy_callbacks;
     std::multimap<jint, ModuleCallback, std::greater<>> modern_callbacks;
+private:
+    // Identity indexes into the priority ordered maps above. Legacy callbacks are keyed by
+    // System.identityHashCode and only compared with IsSameObject on a hash hit, modern
+    // callbacks by their (before, after) pair.
+    std::unordered_multimap<jint, decltype(legacy_callbacks)::iterator> legacy_index;
+    phmap::flat_hash_map<std::pair<jmethodID, jmethodID>, decltype(modern_callbacks)::iterator> modern_index;
+
+    auto FindLegacy(JNIEnv *env, jobject callback, jint identity) {
+        auto [begin, end] = legacy_index.equal_range(identity);
+        for (auto i = begin; i != end; ++i) {
+            if (env->IsSameObject(i->second->second.callback, callback)) return i;
+        }
+        return legacy_index.end();
+    }
+public:
+    // All of the following require the monitor of the item to be held
+    bool HasLegacyCallback(JNIEnv *env, jobject callback, jint identity) {
+        return FindLegacy(env, callback, identity) != legacy_index.end();
+    }
+
+    bool AddLegacyCallback(JNIEnv *env, jint priority, jobject callback, jint identity,
+                           std::unique_ptr<HookGuard> &guard) {
+        if (HasLegacyCallback(env, callback, identity)) return false;
+        legacy_index.emplace(identity, legacy_callbacks.emplace(
+                priority, LegacyCallback{env->NewGlobalRef(callback), std::move(guard)}));
+        return true;
+    }
+
+    bool RemoveLegacyCallback(JNIEnv *env, jobject callback, jint identity) {
+        auto i = FindLegacy(env, callback, identity);
+        if (i == legacy_index.end()) return false;
+        auto &legacy = i->second->second;
+        env->DeleteGlobalRef(legacy.callback);
+        if (legacy.guard) legacy.guard->Release(env);
+        legacy_callbacks.erase(i->second);
+        legacy_index.erase(i);
+        return true;
+    }
+
+    bool HasModernCallback(const ModuleCallback &callback) {
+        return modern_index.contains({callback.before_method, callback.after_method});
+    }
+
+    bool AddModernCallback(JNIEnv *env, jint priority, const ModuleCallback &callback) {
+        auto [i, inserted] = modern_index.try_emplace({callback.before_method, callback.after_method});
+        if (inserted) {
+            auto added = callback;
+            added.callback = env->NewGlobalRef(callback.callback);
+            i->second = modern_callbacks.emplace(priority, added);
+        }
+        return inserted;
+    }
+
+    bool RemoveModernCallback(JNIEnv *env, const ModuleCallback &callback) {
+        auto i = modern_index.find({callback.before_method, callback.after_method});
+        if (i == modern_index.end()) return false;
+        env->DeleteGlobalRef(i->second->second.callback);
+        modern_callbacks.erase(i->second);
+        modern_index.erase(i);
+        return true;
+    }
+
+    bool AddNativeCallback(const NativeCallback &callback) {
+        auto current = GetNativeCallbacks();
+        auto next = current ? std::make_shared<NativeCallbacks>(*current)
+                            : std::make_shared<NativeCallbacks>();
+        for (const auto &c : *next) {
+            if (c.before == callback.before && c.after == callback.after) return false;
+        }
+        next->push_back(callback);
+        std::unique_lock lk(native_lock);
+        native_callbacks = std::move(next);
+        return true;
+    }
+
+    bool RemoveNativeCallback(NativeJavaHookCallback before, NativeJavaHookCallback after) {
+        auto current = GetNativeCallbacks();
+        if (!current) return false;
+        auto next = std::make_shared<NativeCallbacks>(*current);
+        if (!std::erase_if(*next, [&](const auto &c) { return c.before == before && c.after == after; })) {
+            return false;
+        }
+        std::unique_lock lk(native_lock);
+        native_callbacks = next->empty() ? nullptr : std::move(next);
+        return true;
+    }
+
+    bool HasCallbacks() {
+        return !modern_callbacks.empty() || !legacy_callbacks.empty() || GetNativeCallbacks();
+    }
+
+    // Native callbacks are read by the dispatch without the monitor, so they are swapped as
+    // an immutable list. Null when there is none.
+    std::shared_ptr<const NativeCallbacks> GetNativeCallbacks() {
+        std::shared_lock lk(native_lock);
+        return native_callbacks;
+    }
+private:
+    std::shared_mutex native_lock;
+    std::shared_ptr<const NativeCallbacks> native_callbacks;
+public:
+
+    ~HookItem() {
+        JNIEnv *env;
+        // leaked rather than touched from a thread the VM does not know
+        if (monitor && vm->GetEnv(reinterpret_cast<void **>(&env), JNI_VERSION_1_6) == JNI_OK) {
+            env->DeleteGlobalRef(monitor);
+        }
+    }
+
+    // Filled before the backup is published, read-only afterwards
+    std::string shorty;
+    bool is_static = false;
+    jclass declaring_class = nullptr;
+    std::vector<jclass> param_types;
+    jmethodID backup_method = nullptr;
+    // A plain object of the item's own guarding its callbacks. lsplant deletes the backup on
+    // UnHook while other threads may still hold the item, this lives as long as the item does.
+    jobject monitor = nullptr;
+    JavaVM *vm = nullptr;
 private:
     std::atomic<jobject> backup {nullptr};
     static_assert(decltype(backup)::is_always_lock_free);
@@ -56,24 +227,1013 @@ public:
                                        std::memory_order_acq_rel, std::memory_order_relaxed);
         backup.notify_all();
     }
-};
 
-template <class K, class V, class Hash = phmap::priv::hash_default_hash<K>,
-        class Eq = phmap::priv::hash_default_eq<K>,
-        class Alloc = phmap::priv::Allocator<phmap::priv::Pair<const K, V>>, size_t N = 4>
-using SharedHashMap = phmap::parallel_flat_hash_map<K, V, Hash, Eq, Alloc, N, std::shared_mutex>;
+    // Null once the hook failed or was undone, otherwise the monitor to take
+    jobject GetMonitor() {
+        return GetBackup() ? monitor : nullptr;
+    }
+
+    // Called once lsplant::UnHook has deleted the backup
+    void DropBackup() {
+        backup.store(FAILED, std::memory_order_release);
+    }
 
-SharedHashMap<jmethodID, std::unique_ptr<HookItem>> hooked_methods;
+private:
+    // Low bits count the threads currently running the backup. Once the last callback is
+    // removed the item is retired, and whoever brings the count to zero afterwards restores
+    // the target. The backup must never be entered after lsplant::UnHook.
+    std::atomic<uint32_t> dispatch_state {0};
+    static_assert(decltype(dispatch_state)::is_always_lock_free);
+    static constexpr uint32_t kRetired = 1u << 29;
+    static constexpr uint32_t kDying = 1u << 30;
+    static constexpr uint32_t kGone = 1u << 31;
+
+    bool TryKill(uint32_t state) {
+        return state == kRetired &&
+               dispatch_state.compare_exchange_strong(state, kRetired | kDying,
+                                                      std::memory_order_acq_rel,
+                                                      std::memory_order_relaxed);
+    }
+
+    // Wait out a running unhook; returns false if the target has been restored
+    bool WaitAlive(uint32_t &state) {
+        while (state & (kDying | kGone)) {
+            if (state & kGone) return false;
+            dispatch_state.wait(state, std::memory_order_acquire);
+            state = dispatch_state.load(std::memory_order_acquire);
+        }
+        return true;
+    }
+public:
+    // Returns false if the backup must not be called anymore
+    bool BeginOriginal() {
+        auto state = dispatch_state.load(std::memory_order_acquire);
+        do {
+            if (!WaitAlive(state)) return false;
+        } while (!dispatch_state.compare_exchange_weak(state, state + 1,
+                                                       std::memory_order_acq_rel,
+                                                       std::memory_order_acquire));
+        return true;
+    }
+
+    // Returns true if the caller has to restore the target
+    bool EndOriginal() {
+        return TryKill(dispatch_state.fetch_sub(1, std::memory_order_acq_rel) - 1);
+    }
+
+    // Called with the monitor held once no callback is left.
+    // Returns true if the caller has to restore the target
+    bool Retire() {
+        return TryKill(dispatch_state.fetch_or(kRetired, std::memory_order_acq_rel) | kRetired);
+    }
+
+    // Called with the monitor held before adding a callback.
+    // Returns false if the target has been restored and a new item is needed
+    bool Revive() {
+        auto state = dispatch_state.load(std::memory_order_acquire);
+        do {
+            if (!WaitAlive(state)) return false;
+        } while (!dispatch_state.compare_exchange_weak(state, state & ~kRetired,
+                                                       std::memory_order_acq_rel,
+                                                       std::memory_order_acquire));
+        return true;
+    }
+
+    bool IsGone() {
+        return dispatch_state.load(std::memory_order_acquire) & kGone;
+    }
+
+    void FinishDying(bool unhooked) {
+        dispatch_state.store(unhooked ? kGone : 0, std::memory_order_release);
+        dispatch_state.notify_all();
+    }
+};
+
+// Looked up on every hooked call, written only when hooking or unhooking
+lspd::RcuMap<jmethodID, HookItem> hooked_methods;
 
 jmethodID invoke = nullptr;
-jmethodID callback_ctor = nullptr;
+jclass system_class = nullptr;
+jmethodID identity_hash_code = nullptr;
+jclass object_class = nullptr;
+jclass invocation_target_exception_class = nullptr;
+jmethodID get_cause = nullptr;
+jmethodID invocation_target_exception_init = nullptr;
+std::once_flag callback_fields_once;
 jfieldID before_method_field = nullptr;
 jfieldID after_method_field = nullptr;
+
+jclass method_class = nullptr;
+jmethodID get_parameter_types = nullptr;
+jmethodID get_return_type = nullptr;
+jmethodID get_declaring_class = nullptr;
+jmethodID get_modifiers = nullptr;
+
+jclass native_hooker_class = nullptr;
+
+// What installing a hook needs from a hooker class, looked up once per class. In practice
+// NativeHooker is the only one, so a short list compared with IsSameObject does.
+struct HookerInfo {
+    jclass clazz;      // global reference
+    jmethodID init;
+    jobject callback;  // reflected callback(Object[]), global reference
+};
+std::shared_mutex hookers_lock;
+std::vector<std::unique_ptr<const HookerInfo>> hookers;
+
+jclass string_class = nullptr;
+jfieldID guard_ops_field = nullptr;
+jfieldID guard_operands_field = nullptr;
+jfieldID guard_not_reentrant_field = nullptr;
+std::once_flag guard_fields_once;
+jobjectArray empty_snapshot = nullptr;
+
+// Hooked methods whose reentrancy guarded callbacks are running on this thread
+thread_local phmap::flat_hash_map<jmethodID, uint32_t> dispatching;
+
+// One Java dispatch in flight. The frame is an Object[3] holding the modern and legacy
+// snapshots and the recycler NativeHooker keeps its reusable objects in.
+struct DispatchFrame {
+    jobjectArray frame;
+    jmethodID target = nullptr;
+    bool not_reentrant = false;
+};
+
+// Frames left behind by exited threads, the refs cannot be deleted without an attached env
+std::mutex spare_frames_lock;
+std::vector<jobjectArray> spare_frames;
+std::atomic<uint64_t> frames_allocated{0};
+std::atomic<uint64_t> frames_reused{0};
+
+// Frames of this thread indexed by nesting depth, so reentrant hooked calls get their own
+thread_local struct FramePool {
+    std::vector<DispatchFrame> frames;
+    size_t depth = 0;
+
+    ~FramePool() {
+        std::lock_guard lk(spare_frames_lock);
+        for (const auto &frame : frames) spare_frames.push_back(frame.frame);
+    }
+} frame_pool;
+
+std::string ToDescriptor(std::string_view class_name) {
+    std::string descriptor = "L";
+    descriptor.append(class_name);
+    std::replace(descriptor.begin(), descriptor.end(), '.', '/');
+    return descriptor.append(";");
+}
+
+// Descriptors of the classes LSPosedLazyHooks waits for, checked after every class definition
+std::shared_mutex watched_classes_lock;
+phmap::flat_hash_set<std::string> watched_classes;
+std::atomic<size_t> watched_count{0};
+
+// Looks classes up in the class tables of a loader and its parents. Unlike
+// ClassLoader.findLoadedClass, this never defines the class. Boot classes are not looked for.
+class ClassTableLookup {
+public:
+    static const ClassTableLookup *Get(JNIEnv *env) {
+        static ClassTableLookup *lookup = [env]() -> ClassTableLookup * {
+            auto *lookup = new ClassTableLookup;
+            if (lookup->Init(env)) return lookup;
+            delete lookup;
+            return nullptr;
+        }();
+        return lookup;
+    }
+
+    struct Query {
+        std::string descriptor;
+        uint32_t hash = 0;
+        std::vector<void *> tables;
+    };
+
+    Query MakeQuery(JNIEnv *env, jobject loader, std::string descriptor) const {
+        Query query{.descriptor = std::move(descriptor)};
+        for (unsigned char c : query.descriptor) query.hash = query.hash * 31 + c;
+        for (ScopedLocalRef current(env, env->NewLocalRef(loader)); current;
+             current.reset(env->GetObjectField(current.get(), parent_field_))) {
+            if (auto table = env->GetLongField(current.get(), class_table_field_)) {
+                query.tables.push_back(reinterpret_cast<void *>(table));
+            }
+        }
+        return query;
+    }
+
+    std::vector<bool> AreDefined(const std::vector<Query> &queries) const {
+        std::vector<bool> defined(queries.size());
+        if (std::all_of(queries.begin(), queries.end(), [](auto &q) { return q.tables.empty(); })) {
+            return defined;
+        }
+        // class tables may only be read with the mutator lock, which a native method only gets
+        // by suspending everyone else, once for the whole batch
+        alignas(void *) char suspend_all[sizeof(void *)];
+        suspend_all_(suspend_all, "lspd class lookup", false);
+        for (size_t i = 0; i < queries.size(); ++i) {
+            const auto &query = queries[i];
+            defined[i] = std::any_of(query.tables.begin(), query.tables.end(), [&](void *table) {
+                return lookup_(table, query.descriptor.c_str(), query.hash) != nullptr;
+            });
+        }
+        resume_all_(suspend_all);
+        return defined;
+    }
+
+private:
+    bool Init(JNIEnv *env) {
+        const auto &art = lspd::GetArt();
+        if (!art || !art->isValid()) return false;
+        lookup_ = art->getSymbAddress<decltype(lookup_)>(
+                LP_SELECT("_ZN3art10ClassTable6LookupEPKcj", "_ZN3art10ClassTable6LookupEPKcm"));
+        suspend_all_ = art->getSymbAddress<decltype(suspend_all_)>("_ZN3art15ScopedSuspendAllC2EPKcb");
+        resume_all_ = art->getSymbAddress<decltype(resume_all_)>("_ZN3art15ScopedSuspendAllD2Ev");
+        if (!lookup_ || !suspend_all_ || !resume_all_) {
+            LOGW("ClassTableLookup: art symbols missing");
+            return false;
+        }
+        auto class_loader = JNI_FindClass(env, "java/lang/ClassLoader");
+        parent_field_ = JNI_GetFieldID(env, class_loader, "parent", "Ljava/lang/ClassLoader;");
+        class_table_field_ = JNI_GetFieldID(env, class_loader, "classTable", "J");
+        return parent_field_ && class_table_field_;
+    }
+
+    void *(*lookup_)(void *table, const char *descriptor, size_t hash) = nullptr;
+    void (*suspend_all_)(void *thiz, const char *cause, bool long_suspend) = nullptr;
+    void (*resume_all_)(void *thiz) = nullptr;
+    jfieldID parent_field_ = nullptr;
+    jfieldID class_table_field_ = nullptr;
+};
+
+// Watches class definitions through RuntimeCallbacks::ClassPrepare, which ART calls once every class
+// it defines is linked, also the ones resolved natively from code or by the class loader fast path.
+// It is the call the JVMTI ClassPrepare event hangs off; lsplant has no class callback of its own.
+// It returns nothing and gets the class as a handle, so no ObjPtr is passed around. It runs in
+// runnable state, where JNI must not be used, so Java is reached through ArtMethod::Invoke like ART
+// itself does for <clinit>.
+class ClassWatch {
+public:
+    static ClassWatch *Get(JNIEnv *env) {
+        static ClassWatch *watch = [env]() -> ClassWatch * {
+            auto *watch = new ClassWatch;
+            if (watch->Init(env)) return watch;
+            delete watch;
+            return nullptr;
+        }();
+        return watch;
+    }
+
+private:
+    // Handle<mirror::Class> is a single trivially copyable pointer to a StackReference, a
+    // compressed 32 bit reference that the handle scope keeps up to date while Java runs
+    using ClassPrepareType = void (*)(void *callbacks, void *temp_klass, void *klass);
+
+    static void *Decode(void *handle) {
+        return reinterpret_cast<void *>(static_cast<uintptr_t>(*static_cast<uint32_t *>(handle)));
+    }
+
+    static void ClassPrepareReplace(void *callbacks, void *temp_klass, void *klass) {
+        instance_->class_prepare_backup_(callbacks, temp_klass, klass);
+        if (watched_count.load(std::memory_order_acquire) == 0) [[likely]] return;
+        {
+            // the storage is only used for array and proxy classes, which are never watched
+            std::string storage;
+            auto *descriptor = instance_->get_descriptor_(Decode(klass), &storage);
+            std::shared_lock lk(watched_classes_lock);
+            if (!watched_classes.contains(std::string_view(descriptor))) return;
+        }
+        instance_->Dispatch(klass);
+    }
+
+    // Calls LSPosedLazyHooks.onClassDefined, which catches everything it throws
+    void Dispatch(void *klass) const {
+        uint32_t args[] = {*static_cast<uint32_t *>(klass)};
+        uint64_t result = 0;
+        invoke_(on_class_defined_, current_thread_(), args, sizeof(args), &result, "VL");
+    }
+
+    bool Init(JNIEnv *env) {
+        const auto &art = lspd::GetArt();
+        if (!art || !art->isValid()) return false;
+        auto *class_prepare = art->getSymbAddress<void *>(
+                "_ZN3art16RuntimeCallbacks12ClassPrepareENS_6HandleINS_6mirror5ClassEEES4_");
+        get_descriptor_ = art->getSymbAddress<decltype(get_descriptor_)>(
+                "_ZN3art6mirror5Class13GetDescriptorEPNSt3__112basic_stringIcNS2_11char_traitsIcEENS2_9allocatorIcEEEE");
+        current_thread_ = art->getSymbAddress<decltype(current_thread_)>("_ZN3art6Thread14CurrentFromGdbEv");
+        invoke_ = art->getSymbAddress<decltype(invoke_)>("_ZN3art9ArtMethod6InvokeEPNS_6ThreadEPjjPNS_6JValueEPKc");
+        if (!class_prepare || !get_descriptor_ || !current_thread_ || !invoke_) {
+            LOGW("ClassWatch: art symbols missing");
+            return false;
+        }
+
+        auto lazy_hooks = lspd::Context::GetInstance()->FindClassFromCurrentLoader(
+                env, "org.lsposed.lspd.impl.LSPosedLazyHooks");
+        if (!lazy_hooks) return false;
+        auto on_class_defined = JNI_GetStaticMethodID(env, lazy_hooks, "onClassDefined", "(Ljava/lang/Class;)V");
+        if (!on_class_defined) return false;
+        auto executable = JNI_FindClass(env, "java/lang/reflect/Executable");
+        auto art_method_field = JNI_GetFieldID(env, executable, "artMethod", "J");
+        if (!art_method_field) return false;
+        auto reflected = JNI_ToReflectedMethod(env, lazy_hooks, on_class_defined, JNI_TRUE);
+        if (!reflected) return false;
+        on_class_defined_ = reinterpret_cast<void *>(env->GetLongField(reflected.get(), art_method_field));
+        if (!on_class_defined_) return false;
+        // keeps the class, and so the method invoked above, alive
+        lazy_hooks_class_ = JNI_NewGlobalRef(env, lazy_hooks);
+
+        instance_ = this;
+        if (lspd::HookInline(class_prepare, reinterpret_cast<void *>(&ClassPrepareReplace),
+                             reinterpret_cast<void **>(&class_prepare_backup_)) != 0) {
+            instance_ = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    inline static ClassWatch *instance_ = nullptr;
+
+    ClassPrepareType class_prepare_backup_ = nullptr;
+    const char *(*get_descriptor_)(void *klass, std::string *storage) = nullptr;
+    void *(*current_thread_)() = nullptr;
+    void (*invoke_)(void *method, void *self, uint32_t *args, uint32_t args_size, void *result,
+                    const char *shorty) = nullptr;
+    void *on_class_defined_ = nullptr;
+    jclass lazy_hooks_class_ = nullptr;
+};
+
+// Where the time of installing a new hook goes, kept in release builds and switched on at
+// runtime. The last records stay in a ring buffer until the daemon drains them.
+class InstallProfile {
+public:
+    enum Phase {
+        kLookup,      // method ids of the target and the hooker
+        kHooker,      // hooker instance
+        kDescribe,    // shorty, modifiers and declaring class
+        kTrampoline,  // lsplant::Hook
+        kPhaseCount,
+    };
+
+    struct Record {
+        int64_t timestamp_ms;
+        int64_t total_ns;
+        std::array<int64_t, kPhaseCount> phase_ns;
+        bool hooked;
+        std::string method;
+    };
+
+    class Timer {
+        using Clock = std::chrono::steady_clock;
+        const bool on_;
+        Clock::time_point start_;
+        Clock::time_point last_;
+        std::array<int64_t, kPhaseCount> phase_ns_{};
+    public:
+        explicit Timer(bool on) : on_(on) {
+            if (on_) start_ = last_ = Clock::now();
+        }
+
+        explicit operator bool() const { return on_; }
+
+        void Mark(Phase phase) {
+            if (!on_) [[likely]] return;
+            auto now = Clock::now();
+            phase_ns_[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last_).count();
+            last_ = now;
+        }
+
+        Record Finish(bool hooked, std::string method) const {
+            auto now = std::chrono::system_clock::now().time_since_epoch();
+            return {
+                .timestamp_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now).count(),
+                .total_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(last_ - start_).count(),
+                .phase_ns = phase_ns_,
+                .hooked = hooked,
+                .method = std::move(method),
+            };
+        }
+    };
+
+    bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    void SetEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+
+    void Add(Record record) {
+        std::lock_guard lk(lock_);
+        records_[next_] = std::move(record);
+        next_ = (next_ + 1) % records_.size();
+        if (size_ < records_.size()) ++size_;
+    }
+
+    // Oldest first, the buffer is empty afterwards
+    std::vector<Record> Drain() {
+        std::lock_guard lk(lock_);
+        std::vector<Record> res;
+        res.reserve(size_);
+        for (size_t i = (next_ + records_.size() - size_) % records_.size(); size_; --size_) {
+            res.push_back(std::move(records_[i]));
+            i = (i + 1) % records_.size();
+        }
+        return res;
+    }
+
+private:
+    std::atomic<bool> enabled_{false};
+    std::mutex lock_;
+    std::array<Record, 256> records_;
+    size_t next_ = 0;
+    size_t size_ = 0;
+} install_profile;
+
+jmethodID to_string = nullptr;
+
+struct Primitive {
+    char shorty;
+    const char *box_class;
+    const char *unbox_name;
+    const char *unbox_sig;
+    const char *box_sig;
+    jclass type = nullptr;
+    jclass box = nullptr;
+    jmethodID unbox_method = nullptr;
+    jmethodID box_method = nullptr;
+};
+
+Primitive primitives[] = {
+    {'I', "java/lang/Integer", "intValue", "()I", "(I)Ljava/lang/Integer;"},
+    {'J', "java/lang/Long", "longValue", "()J", "(J)Ljava/lang/Long;"},
+    {'Z', "java/lang/Boolean", "booleanValue", "()Z", "(Z)Ljava/lang/Boolean;"},
+    {'F', "java/lang/Float", "floatValue", "()F", "(F)Ljava/lang/Float;"},
+    {'D', "java/lang/Double", "doubleValue", "()D", "(D)Ljava/lang/Double;"},
+    {'B', "java/lang/Byte", "byteValue", "()B", "(B)Ljava/lang/Byte;"},
+    {'C', "java/lang/Character", "charValue", "()C", "(C)Ljava/lang/Character;"},
+    {'S', "java/lang/Short", "shortValue", "()S", "(S)Ljava/lang/Short;"},
+};
+
+const Primitive *FindPrimitive(char shorty) {
+    for (const auto &p : primitives) {
+        if (p.shorty == shorty) return &p;
+    }
+    return nullptr;
+}
+
+char GetTypeShorty(JNIEnv *env, jclass type) {
+    if (type == nullptr) return 'V';
+    for (const auto &p : primitives) {
+        if (env->IsSameObject(type, p.type)) return p.shorty;
+    }
+    static auto void_type = [env]() {
+        auto void_class = JNI_FindClass(env, "java/lang/Void");
+        return static_cast<jclass>(env->NewGlobalRef(JNI_GetStaticObjectField(
+                env, void_class, JNI_GetStaticFieldID(env, void_class, "TYPE", "Ljava/lang/Class;")).get()));
+    }();
+    return env->IsSameObject(type, void_type) ? 'V' : 'L';
+}
+
+std::string GetExecutableShorty(JNIEnv *env, jobject executable,
+                                std::vector<jclass> *param_types = nullptr) {
+    std::string shorty;
+    if (env->IsInstanceOf(executable, method_class)) {
+        auto return_type = JNI_Cast<jclass>(JNI_CallObjectMethod(env, executable, get_return_type));
+        shorty.push_back(GetTypeShorty(env, return_type.get()));
+    } else {
+        shorty.push_back('V');
+    }
+    auto params = JNI_Cast<jobjectArray>(JNI_CallObjectMethod(env, executable, get_parameter_types));
+    for (const auto &param : params) {
+        shorty.push_back(GetTypeShorty(env, static_cast<jclass>(param.get())));
+        if (param_types) param_types->push_back(static_cast<jclass>(env->NewGlobalRef(param.get())));
+    }
+    return shorty;
+}
+
+// Unboxes a boxed primitive of the given shorty, objects are passed through
+jvalue UnboxValue(JNIEnv *env, char shorty, jobject element) {
+    jvalue value{};
+    switch (shorty) {
+        case 'I': value.i = env->CallIntMethod(element, FindPrimitive('I')->unbox_method); break;
+        case 'J': value.j = env->CallLongMethod(element, FindPrimitive('J')->unbox_method); break;
+        case 'Z': value.z = env->CallBooleanMethod(element, FindPrimitive('Z')->unbox_method); break;
+        case 'F': value.f = env->CallFloatMethod(element, FindPrimitive('F')->unbox_method); break;
+        case 'D': value.d = env->CallDoubleMethod(element, FindPrimitive('D')->unbox_method); break;
+        case 'B': value.b = env->CallByteMethod(element, FindPrimitive('B')->unbox_method); break;
+        case 'C': value.c = env->CallCharMethod(element, FindPrimitive('C')->unbox_method); break;
+        case 'S': value.s = env->CallShortMethod(element, FindPrimitive('S')->unbox_method); break;
+        default:
+        case 'L': value.l = element; break;
+    }
+    return value;
+}
+
+// Shorty of the primitive element boxes, 0 if it is no box
+char GetBoxedShorty(JNIEnv *env, jobject element, char expected) {
+    if (env->IsInstanceOf(element, FindPrimitive(expected)->box)) [[likely]] return expected;
+    for (const auto &p : primitives) {
+        if (env->IsInstanceOf(element, p.box)) return p.shorty;
+    }
+    return 0;
+}
+
+// The widening primitive conversions Method.invoke applies to arguments
+bool CanWiden(char from, char to) {
+    if (from == to) return true;
+    switch (from) {
+        case 'B': return to == 'S' || to == 'I' || to == 'J' || to == 'F' || to == 'D';
+        case 'S':
+        case 'C': return to == 'I' || to == 'J' || to == 'F' || to == 'D';
+        case 'I': return to == 'J' || to == 'F' || to == 'D';
+        case 'J': return to == 'F' || to == 'D';
+        case 'F': return to == 'D';
+        default: return false;
+    }
+}
+
+jvalue Widen(char from, char to, const jvalue &value) {
+    if (from == to) return value;
+    jlong integral = 0;
+    switch (from) {
+        case 'B': integral = value.b; break;
+        case 'S': integral = value.s; break;
+        case 'C': integral = value.c; break;
+        case 'I': integral = value.i; break;
+        case 'J': integral = value.j; break;
+        default: break;
+    }
+    jvalue res{};
+    switch (to) {
+        case 'S': res.s = static_cast<jshort>(integral); break;
+        case 'I': res.i = static_cast<jint>(integral); break;
+        case 'J': res.j = integral; break;
+        case 'F': res.f = static_cast<jfloat>(integral); break;
+        case 'D': res.d = from == 'F' ? value.f : static_cast<jdouble>(integral); break;
+        default: break;
+    }
+    return res;
+}
+
+// Unboxes args[offset...] into jvalues according to the parameter part of shorty.
+// With param_types the elements are checked and widened like Method.invoke does, as the
+// jvalues are handed to JNI unchecked
+bool UnboxArgs(JNIEnv *env, std::string_view shorty, jobjectArray args, jsize offset, jvalue *out,
+               const jclass *param_types = nullptr) {
+    for (size_t i = 1; i < shorty.size(); ++i) {
+        auto *element = env->GetObjectArrayElement(args, static_cast<jsize>(offset + i - 1));
+        auto &value = out[i - 1];
+        char from = shorty[i];
+        if (param_types) {
+            bool matches = shorty[i] == 'L'
+                           ? !element || env->IsInstanceOf(element, param_types[i - 1])
+                           : element && CanWiden(from = GetBoxedShorty(env, element, shorty[i]), shorty[i]);
+            if (!matches) {
+                env->DeleteLocalRef(element);
+                env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "argument type mismatch");
+                return false;
+            }
+        }
+        value = Widen(from, shorty[i], UnboxValue(env, from, element));
+        // objects keep their local reference alive for the call
+        if (shorty[i] != 'L') env->DeleteLocalRef(element);
+        if (env->ExceptionCheck()) return false;
+    }
+    return true;
+}
+
+// Calls method with the given receiver (or statically if thiz is null)
+jvalue InvokeRaw(JNIEnv *env, char return_shorty, jobject thiz, jclass cls, jmethodID method,
+                 const jvalue *args) {
+    jvalue res{};
+    switch (return_shorty) {
+        case 'I': res.i = thiz ? env->CallNonvirtualIntMethodA(thiz, cls, method, args) : env->CallStaticIntMethodA(cls, method, args); break;
+        case 'J': res.j = thiz ? env->CallNonvirtualLongMethodA(thiz, cls, method, args) : env->CallStaticLongMethodA(cls, method, args); break;
+        case 'Z': res.z = thiz ? env->CallNonvirtualBooleanMethodA(thiz, cls, method, args) : env->CallStaticBooleanMethodA(cls, method, args); break;
+        case 'F': res.f = thiz ? env->CallNonvirtualFloatMethodA(thiz, cls, method, args) : env->CallStaticFloatMethodA(cls, method, args); break;
+        case 'D': res.d = thiz ? env->CallNonvirtualDoubleMethodA(thiz, cls, method, args) : env->CallStaticDoubleMethodA(cls, method, args); break;
+        case 'B': res.b = thiz ? env->CallNonvirtualByteMethodA(thiz, cls, method, args) : env->CallStaticByteMethodA(cls, method, args); break;
+        case 'C': res.c = thiz ? env->CallNonvirtualCharMethodA(thiz, cls, method, args) : env->CallStaticCharMethodA(cls, method, args); break;
+        case 'S': res.s = thiz ? env->CallNonvirtualShortMethodA(thiz, cls, method, args) : env->CallStaticShortMethodA(cls, method, args); break;
+        case 'L': res.l = thiz ? env->CallNonvirtualObjectMethodA(thiz, cls, method, args) : env->CallStaticObjectMethodA(cls, method, args); break;
+        default:
+        case 'V':
+            thiz ? env->CallNonvirtualVoidMethodA(thiz, cls, method, args) : env->CallStaticVoidMethodA(cls, method, args);
+            break;
+    }
+    return res;
+}
+
+jobject BoxValue(JNIEnv *env, char shorty, const jvalue &value) {
+    if (shorty == 'L') return value.l;
+    if (shorty == 'V') return nullptr;
+    auto *p = FindPrimitive(shorty);
+    return env->CallStaticObjectMethodA(p->box, p->box_method, &value);
+}
+
+// Calls method with the given receiver (or statically if thiz is null) and boxes the result
+jobject InvokeAndBox(JNIEnv *env, char return_shorty, jobject thiz, jclass cls, jmethodID method,
+                     const jvalue *args) {
+    auto res = InvokeRaw(env, return_shorty, thiz, cls, method, args);
+    if (env->ExceptionCheck()) return nullptr;
+    return BoxValue(env, return_shorty, res);
+}
+
+void DropCallbackException(JNIEnv *env) {
+    if (!env->ExceptionCheck()) [[likely]] return;
+    LOGE("Native hook callback returned with a pending exception, ignoring it");
+    env->ExceptionDescribe();
+    env->ExceptionClear();
+}
+
+// Calls the backup wrapped by the native callbacks of the item and boxes the result.
+// Must run between BeginOriginal and EndOriginal
+jobject DispatchOriginal(JNIEnv *env, jmethodID target, HookItem &item, jobject thiz, jvalue *args) {
+    const char return_shorty = item.shorty[0];
+    auto callbacks = item.GetNativeCallbacks();
+    if (!callbacks) [[likely]] {
+        return InvokeAndBox(env, return_shorty, thiz, item.declaring_class, item.backup_method, args);
+    }
+    NativeJavaHookParam param{
+            .env = env,
+            .method = target,
+            .thiz = thiz,
+            .args = args,
+            .result = {},
+            .throwable = nullptr,
+            .skip_original = JNI_FALSE,
+            .data = nullptr,
+    };
+    size_t before_idx = 0;
+    while (before_idx < callbacks->size() && !param.skip_original) {
+        const auto &callback = (*callbacks)[before_idx++];
+        if (!callback.before) continue;
+        param.data = callback.data;
+        callback.before(&param);
+        DropCallbackException(env);
+    }
+    if (!param.skip_original) {
+        param.result = InvokeRaw(env, return_shorty, thiz, item.declaring_class, item.backup_method, args);
+        param.throwable = env->ExceptionOccurred();
+        if (param.throwable) env->ExceptionClear();
+    }
+    while (before_idx > 0) {
+        const auto &callback = (*callbacks)[--before_idx];
+        if (!callback.after) continue;
+        param.data = callback.data;
+        callback.after(&param);
+        DropCallbackException(env);
+    }
+    if (param.throwable) {
+        env->Throw(param.throwable);
+        return nullptr;
+    }
+    return BoxValue(env, return_shorty, param.result);
+}
+
+std::shared_ptr<HookItem> FindHookItem(jmethodID target) {
+    return hooked_methods.Find(target);
+}
+
+jint IdentityHashCode(JNIEnv *env, jobject object) {
+    return env->CallStaticIntMethod(system_class, identity_hash_code, object);
+}
+
+ModuleCallback GetModuleCallback(JNIEnv *env, jobject callback) {
+    std::call_once(callback_fields_once, [env, callback] {
+        auto callback_class = JNI_GetObjectClass(env, callback);
+        before_method_field = JNI_GetFieldID(env, callback_class, "beforeInvocation", "Ljava/lang/reflect/Method;");
+        after_method_field = JNI_GetFieldID(env, callback_class, "afterInvocation", "Ljava/lang/reflect/Method;");
+    });
+    auto before_method = JNI_GetObjectField(env, callback, before_method_field);
+    auto after_method = JNI_GetObjectField(env, callback, after_method_field);
+    return {
+            .before_method = env->FromReflectedMethod(before_method.get()),
+            .after_method = env->FromReflectedMethod(after_method.get()),
+            .callback = callback,
+    };
+}
+
+// Null with an exception pending if the class is no usable hooker
+const HookerInfo *GetHookerInfo(JNIEnv *env, jclass hooker) {
+    {
+        std::shared_lock lk(hookers_lock);
+        for (const auto &info : hookers) {
+            if (env->IsSameObject(info->clazz, hooker)) [[likely]] return info.get();
+        }
+    }
+    auto init = JNI_GetMethodID(env, hooker, "<init>", "(Ljava/lang/reflect/Executable;)V");
+    auto callback = JNI_GetMethodID(env, hooker, "callback", "([Ljava/lang/Object;)Ljava/lang/Object;");
+    if (!init || !callback) return nullptr;
+    auto callback_method = JNI_ToReflectedMethod(env, hooker, callback, JNI_FALSE);
+    std::unique_lock lk(hookers_lock);
+    for (const auto &info : hookers) {
+        if (env->IsSameObject(info->clazz, hooker)) return info.get();
+    }
+    return hookers.emplace_back(std::make_unique<const HookerInfo>(HookerInfo{
+            .clazz = static_cast<jclass>(env->NewGlobalRef(hooker)),
+            .init = init,
+            .callback = env->NewGlobalRef(callback_method.get()),
+    })).get();
+}
+
+// Reads an XC_MethodHook.Guard. Throws IllegalArgumentException if it does not fit the method
+std::unique_ptr<HookGuard> ParseGuard(JNIEnv *env, jobject hook_method, jobject guard) {
+    std::call_once(guard_fields_once, [env, guard] {
+        auto guard_class = JNI_GetObjectClass(env, guard);
+        guard_ops_field = JNI_GetFieldID(env, guard_class, "ops", "[I");
+        guard_operands_field = JNI_GetFieldID(env, guard_class, "operands", "[Ljava/lang/Object;");
+        guard_not_reentrant_field = JNI_GetFieldID(env, guard_class, "notReentrant", "Z");
+    });
+    auto shorty = GetExecutableShorty(env, hook_method);
+    auto result = std::make_unique<HookGuard>();
+    result->not_reentrant = env->GetBooleanField(guard, guard_not_reentrant_field);
+    auto ops = JNI_Cast<jintArray>(JNI_GetObjectField(env, guard, guard_ops_field));
+    auto operands = JNI_Cast<jobjectArray>(JNI_GetObjectField(env, guard, guard_operands_field));
+    auto count = env->GetArrayLength(operands.get());
+    std::vector<jint> raw_ops(count * 2);
+    env->GetIntArrayRegion(ops.get(), 0, count * 2, raw_ops.data());
+    if (env->ExceptionCheck()) return nullptr;
+    const char *error = nullptr;
+    for (jsize i = 0; i < count && !error; ++i) {
+        auto &c = result->conditions.emplace_back(HookGuard::Condition{
+                .op = static_cast<HookGuard::Op>(raw_ops[i * 2]),
+                .index = raw_ops[i * 2 + 1],
+                .value = {},
+        });
+        if (c.index < 0 || static_cast<size_t>(c.index) + 1 >= shorty.size()) {
+            error = "guard argument index out of range";
+            break;
+        }
+        c.shorty = shorty[c.index + 1];
+        ScopedLocalRef operand(env, env->GetObjectArrayElement(operands.get(), i));
+        switch (c.op) {
+            case HookGuard::kArgNull:
+            case HookGuard::kArgNotNull:
+                if (c.shorty != 'L') error = "guard null check on a primitive argument";
+                break;
+            case HookGuard::kArgInstanceOf:
+                if (c.shorty != 'L') error = "guard instanceof check on a primitive argument";
+                else c.type = static_cast<jclass>(env->NewGlobalRef(operand.get()));
+                break;
+            case HookGuard::kArgEquals:
+                if (c.shorty == 'L') {
+                    if (!env->IsInstanceOf(operand.get(), string_class)) {
+                        error = "guard compares an object argument with a non-String value";
+                        break;
+                    }
+                    auto str = static_cast<jstring>(operand.get());
+                    c.string.resize(env->GetStringLength(str));
+                    env->GetStringRegion(str, 0, static_cast<jsize>(c.string.size()),
+                                         reinterpret_cast<jchar *>(c.string.data()));
+                } else if (env->IsInstanceOf(operand.get(), FindPrimitive(c.shorty)->box)) {
+                    c.value = UnboxValue(env, c.shorty, operand.get());
+                } else {
+                    error = "guard value does not match the argument type";
+                }
+                break;
+            default:
+                error = "unknown guard condition";
+                break;
+        }
+    }
+    if (error || env->ExceptionCheck()) {
+        result->Release(env);
+        if (error && !env->ExceptionCheck()) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), error);
+        }
+        return nullptr;
+    }
+    return result;
+}
+
+bool ArgEquals(JNIEnv *env, const HookGuard::Condition &c, jobject arg) {
+    if (arg == nullptr) return false;
+    if (c.shorty == 'L') {
+        if (!env->IsInstanceOf(arg, string_class)) return false;
+        auto str = static_cast<jstring>(arg);
+        auto len = env->GetStringLength(str);
+        if (static_cast<size_t>(len) != c.string.size()) return false;
+        auto *chars = env->GetStringCritical(str, nullptr);
+        bool equal = std::char_traits<char16_t>::compare(
+                reinterpret_cast<const char16_t *>(chars), c.string.data(), len) == 0;
+        env->ReleaseStringCritical(str, chars);
+        return equal;
+    }
+    // lsplant boxed the primitive with the exact type of the parameter
+    auto value = UnboxValue(env, c.shorty, arg);
+    switch (c.shorty) {
+        case 'I': return value.i == c.value.i;
+        case 'J': return value.j == c.value.j;
+        case 'Z': return value.z == c.value.z;
+        case 'F': return value.f == c.value.f;
+        case 'D': return value.d == c.value.d;
+        case 'B': return value.b == c.value.b;
+        case 'C': return value.c == c.value.c;
+        case 'S': return value.s == c.value.s;
+        default: return false;
+    }
+}
+
+// Checks a guard against the raw arguments of lsplant, offset skips this
+bool GuardHolds(JNIEnv *env, const HookGuard &guard, jobjectArray args, jsize offset, bool reentered) {
+    if (guard.not_reentrant && reentered) return false;
+    for (const auto &c : guard.conditions) {
+        ScopedLocalRef arg(env, env->GetObjectArrayElement(args, offset + c.index));
+        bool holds;
+        switch (c.op) {
+            case HookGuard::kArgNull: holds = arg.get() == nullptr; break;
+            case HookGuard::kArgNotNull: holds = arg.get() != nullptr; break;
+            case HookGuard::kArgInstanceOf: holds = arg.get() != nullptr && env->IsInstanceOf(arg.get(), c.type); break;
+            case HookGuard::kArgEquals: holds = ArgEquals(env, c, arg.get()); break;
+            default: holds = true; break;
+        }
+        if (!holds) return false;
+    }
+    return true;
+}
+
+// Takes the frame of the next nesting depth on this thread, creating one on first use
+DispatchFrame *AcquireFrame(JNIEnv *env) {
+    auto &pool = frame_pool;
+    if (pool.depth < pool.frames.size()) {
+        frames_reused.fetch_add(1, std::memory_order_relaxed);
+        return &pool.frames[pool.depth++];
+    }
+    jobjectArray frame = nullptr;
+    {
+        std::lock_guard lk(spare_frames_lock);
+        if (!spare_frames.empty()) {
+            frame = spare_frames.back();
+            spare_frames.pop_back();
+        }
+    }
+    if (frame) {
+        frames_reused.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        ScopedLocalRef local(env, env->NewObjectArray(3, object_class, nullptr));
+        if (!local) return nullptr;
+        frame = static_cast<jobjectArray>(env->NewGlobalRef(local.get()));
+        frames_allocated.fetch_add(1, std::memory_order_relaxed);
+    }
+    pool.frames.push_back({.frame = frame});
+    return &pool.frames[pool.depth++];
+}
+
+void ReleaseFrame() {
+    auto &pool = frame_pool;
+    if (pool.depth == 0) return;
+    auto &frame = pool.frames[--pool.depth];
+    if (frame.not_reentrant) {
+        auto i = dispatching.find(frame.target);
+        if (i != dispatching.end() && --i->second == 0) dispatching.erase(i);
+    }
+    frame.target = nullptr;
+    frame.not_reentrant = false;
+}
+
+// Returns the Object[] at index of frame if it has the length, otherwise puts a new one there
+ScopedLocalRef<jobjectArray> ReuseArray(JNIEnv *env, jobjectArray frame, jsize index, jsize length) {
+    ScopedLocalRef array(env, static_cast<jobjectArray>(env->GetObjectArrayElement(frame, index)));
+    if (array && env->GetArrayLength(array.get()) == length) return array;
+    array.reset(env->NewObjectArray(length, object_class, nullptr));
+    if (array) env->SetObjectArrayElement(frame, index, array.get());
+    return array;
+}
+
+// Puts the original method back once the item has been retired and drained
+void RestoreOriginal(JNIEnv *env, jobject hook_method, jmethodID target,
+                     const std::shared_ptr<HookItem> &hook_item) {
+    auto pending = env->ExceptionOccurred();
+    if (pending) env->ExceptionClear();
+    // keep the item reachable until the trampoline is gone, later calls still need the backup
+    bool unhooked = lsplant::UnHook(env, hook_method);
+    if (unhooked) {
+        hook_item->DropBackup();
+        hooked_methods.EraseIf(target, hook_item.get());
+        env->DeleteGlobalRef(hook_item->declaring_class);
+        for (auto *type : hook_item->param_types) env->DeleteGlobalRef(type);
+    } else {
+        LOGW("Failed to restore original method, keeping the hook");
+    }
+    hook_item->FinishDying(unhooked);
+    if (pending) {
+        env->Throw(pending);
+        env->DeleteLocalRef(pending);
+    }
+}
+
+// Hooks the target unless it already is and calls add with the monitor of the item held
+template<typename AddCallback>
+bool AddHookCallback(JNIEnv *env, jobject hook_method, jclass hooker, bool &new_hook, AddCallback &&add) {
+    auto target = env->FromReflectedMethod(hook_method);
+    std::shared_ptr<HookItem> hook_item;
+    while (true) {
+        std::tie(hook_item, new_hook) = hooked_methods.FindOrInsert(target, [] {
+            return std::make_shared<HookItem>();
+        });
+        if (new_hook) {
+            InstallProfile::Timer timer(install_profile.enabled());
+            const auto *hooker_info = GetHookerInfo(env, hooker);
+            timer.Mark(InstallProfile::kLookup);
+            if (!hooker_info) {
+                hook_item->SetBackup(nullptr);
+                hooked_methods.EraseIf(target, hook_item.get());
+                return false;
+            }
+            auto hooker_object = env->NewObject(hooker_info->clazz, hooker_info->init, hook_method);
+            timer.Mark(InstallProfile::kHooker);
+            hook_item->shorty = GetExecutableShorty(env, hook_method, &hook_item->param_types);
+            hook_item->is_static = (JNI_CallIntMethod(env, hook_method, get_modifiers) & 0x0008) != 0;
+            hook_item->declaring_class = static_cast<jclass>(env->NewGlobalRef(
+                    JNI_CallObjectMethod(env, hook_method, get_declaring_class).get()));
+            hook_item->monitor = env->NewGlobalRef(ScopedLocalRef(env, env->AllocObject(object_class)).get());
+            env->GetJavaVM(&hook_item->vm);
+            timer.Mark(InstallProfile::kDescribe);
+            auto backup = lsplant::Hook(env, hook_method, hooker_object, hooker_info->callback);
+            timer.Mark(InstallProfile::kTrampoline);
+            if (backup) hook_item->backup_method = env->FromReflectedMethod(backup);
+            hook_item->SetBackup(backup);
+            env->DeleteLocalRef(hooker_object);
+            if (timer) [[unlikely]] {
+                // named after the clock stopped, toString is not part of the install
+                auto name = JNI_Cast<jstring>(JNI_CallObjectMethod(env, hook_method, to_string));
+                install_profile.Add(timer.Finish(backup != nullptr, name ? JUTFString(env, name.get()).get() : ""));
+            }
+        }
+        jobject item_monitor = hook_item->GetMonitor();
+        if (!item_monitor) {
+            if (!hook_item->IsGone()) return false;
+            // the previous hook was undone since it was looked up, install a fresh one
+            hooked_methods.EraseIf(target, hook_item.get());
+            continue;
+        }
+        JNIMonitor monitor(env, item_monitor);
+        if (!hook_item->Revive()) {
+            // the previous hook was just undone, drop it and install a fresh one
+            hooked_methods.EraseIf(target, hook_item.get());
+            continue;
+        }
+        add(*hook_item);
+        return true;
+    }
+}
+
+// Removes a callback with the monitor of the item held and restores the target if it was
+// the last one
+template<typename RemoveCallback>
+bool RemoveHookCallback(JNIEnv *env, jobject hook_method, RemoveCallback &&remove) {
+    auto target = env->FromReflectedMethod(hook_method);
+    auto hook_item = FindHookItem(target);
+    if (!hook_item) return false;
+    jobject item_monitor = hook_item->GetMonitor();
+    if (!item_monitor) return false;
+    bool removed = false;
+    bool restore = false;
+    {
+        JNIMonitor monitor(env, item_monitor);
+        removed = remove(*hook_item);
+        if (removed && !hook_item->HasCallbacks()) {
+            restore = hook_item->Retire();
+        }
+    }
+    if (restore) RestoreOriginal(env, hook_method, target, hook_item);
+    return removed;
+}
+
+// Method.invoke, but rethrowing what the method threw instead of InvocationTargetException
+jobject InvokeOriginalUnwrapped(JNIEnv *env, jobject method, jobject thiz, jobjectArray args) {
+    auto res = env->CallObjectMethod(method, invoke, thiz, args);
+    if (auto *exception = env->ExceptionOccurred()) {
+        if (env->IsInstanceOf(exception, invocation_target_exception_class)) {
+            env->ExceptionClear();
+            env->Throw(static_cast<jthrowable>(env->CallObjectMethod(exception, get_cause)));
+        }
+        env->DeleteLocalRef(exception);
+    }
+    return res;
+}
+
+// Calls a method that is no longer hooked with the raw argument array lsplant gave us
+jobject InvokeRestoredRaw(JNIEnv *env, jobject hook_method, jobjectArray args) {
+    jsize offset = (JNI_CallIntMethod(env, hook_method, get_modifiers) & 0x0008) ? 0 : 1;
+    auto len = env->GetArrayLength(args);
+    if (len < offset) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "this == null");
+        return nullptr;
+    }
+    auto *thiz = offset ? env->GetObjectArrayElement(args, 0) : nullptr;
+    auto *rest = env->NewObjectArray(len - offset, object_class, nullptr);
+    for (jsize i = offset; i < len; ++i) {
+        auto *element = env->GetObjectArrayElement(args, i);
+        env->SetObjectArrayElement(rest, i - offset, element);
+        env->DeleteLocalRef(element);
+    }
+    auto res = InvokeOriginalUnwrapped(env, hook_method, thiz, rest);
+    env->DeleteLocalRef(rest);
+    return res;
+}
 }
 
 namespace lspd {
 LSP_DEF_NATIVE_METHOD(jboolean, HookBridge, hookMethod, jboolean useModernApi, jobject hookMethod,
-                      jclass hooker, jint priority, jobject callback) {
+                      jclass hooker, jint priority, jobject callback, jobject guard) {
+    std::unique_ptr<HookGuard> hook_guard;
+    if (guard && !useModernApi && !(hook_guard = ParseGuard(env, hookMethod, guard))) return JNI_FALSE;
     bool newHook = false;
 #ifndef NDEBUG
     struct finally {
@@ -90,77 +1250,39 @@ LSP_DEF_NATIVE_METHOD(jboolean, HookBridge, hookMethod, jboolean useModernApi, j
         .newHook = newHook
     };
 #endif
-    auto target = env->FromReflectedMethod(hookMethod);
-    HookItem * hook_item = nullptr;
-    hooked_methods.lazy_emplace_l(target, [&hook_item](auto &it) {
-        hook_item = it.second.get();
-    }, [&hook_item, &target, &newHook](const auto &ctor) {
-        auto ptr = std::make_unique<HookItem>();
-        hook_item = ptr.get();
-        ctor(target, std::move(ptr));
-        newHook = true;
+    return AddHookCallback(env, hookMethod, hooker, newHook, [&](HookItem &hook_item) {
+        if (useModernApi) {
+            // registering the same callback again is a no-op, like the old Xposed callback set
+            hook_item.AddModernCallback(env, priority, GetModuleCallback(env, callback));
+        } else {
+            if (!hook_item.AddLegacyCallback(env, priority, callback, IdentityHashCode(env, callback), hook_guard)) {
+                if (hook_guard) hook_guard->Release(env);
+            }
+        }
     });
-    if (newHook) {
-        auto init = env->GetMethodID(hooker, "<init>", "(Ljava/lang/reflect/Executable;)V");
-        auto callback_method = env->ToReflectedMethod(hooker, env->GetMethodID(hooker, "callback",
-                                                                               "([Ljava/lang/Object;)Ljava/lang/Object;"),
-                                                      false);
-        auto hooker_object = env->NewObject(hooker, init, hookMethod);
-        hook_item->SetBackup(lsplant::Hook(env, hookMethod, hooker_object, callback_method));
-        env->DeleteLocalRef(hooker_object);
-    }
-    jobject backup = hook_item->GetBackup();
-    if (!backup) return JNI_FALSE;
-    JNIMonitor monitor(env, backup);
-    if (useModernApi) {
-        if (before_method_field == nullptr) {
-            auto callback_class = JNI_GetObjectClass(env, callback);
-            callback_ctor = JNI_GetMethodID(env, callback_class, "<init>", "(Ljava/lang/reflect/Method;Ljava/lang/reflect/Method;)V");
-            before_method_field = JNI_GetFieldID(env, callback_class, "beforeInvocation", "Ljava/lang/reflect/Method;");
-            after_method_field = JNI_GetFieldID(env, callback_class, "afterInvocation", "Ljava/lang/reflect/Method;");
-        }
-        auto before_method = JNI_GetObjectField(env, callback, before_method_field);
-        auto after_method = JNI_GetObjectField(env, callback, after_method_field);
-        auto callback_type = ModuleCallback {
-                .before_method = env->FromReflectedMethod(before_method.get()),
-                .after_method = env->FromReflectedMethod(after_method.get()),
-        };
-        hook_item->modern_callbacks.emplace(priority, callback_type);
-    } else {
-        hook_item->legacy_callbacks.emplace(priority, env->NewGlobalRef(callback));
-    }
-    return JNI_TRUE;
 }
 
 LSP_DEF_NATIVE_METHOD(jboolean, HookBridge, unhookMethod, jboolean useModernApi, jobject hookMethod, jobject callback) {
-    auto target = env->FromReflectedMethod(hookMethod);
-    HookItem * hook_item = nullptr;
-    hooked_methods.if_contains(target, [&hook_item](const auto &it) {
-        hook_item = it.second.get();
+    return RemoveHookCallback(env, hookMethod, [&](HookItem &hook_item) {
+        if (useModernApi) {
+            return hook_item.RemoveModernCallback(env, GetModuleCallback(env, callback));
+        } else {
+            return hook_item.RemoveLegacyCallback(env, callback, IdentityHashCode(env, callback));
+        }
     });
+}
+
+LSP_DEF_NATIVE_METHOD(jboolean, HookBridge, isHooked, jboolean useModernApi, jobject hookMethod, jobject callback) {
+    auto hook_item = FindHookItem(env->FromReflectedMethod(hookMethod));
     if (!hook_item) return JNI_FALSE;
-    jobject backup = hook_item->GetBackup();
-    if (!backup) return JNI_FALSE;
-    JNIMonitor monitor(env, backup);
+    jobject item_monitor = hook_item->GetMonitor();
+    if (!item_monitor) return JNI_FALSE;
+    JNIMonitor monitor(env, item_monitor);
     if (useModernApi) {
-        auto before_method = JNI_GetObjectField(env, callback, before_method_field);
-        auto before = env->FromReflectedMethod(before_method.get());
-        for (auto i = hook_item->modern_callbacks.begin(); i != hook_item->modern_callbacks.end(); ++i) {
-            if (before == i->second.before_method) {
-                hook_item->modern_callbacks.erase(i);
-                return JNI_TRUE;
-            }
-        }
+        return hook_item->HasModernCallback(GetModuleCallback(env, callback));
     } else {
-        for (auto i = hook_item->legacy_callbacks.begin(); i != hook_item->legacy_callbacks.end(); ++i) {
-            if (env->IsSameObject(i->second, callback)) {
-                env->DeleteGlobalRef(i->second);
-                hook_item->legacy_callbacks.erase(i);
-                return JNI_TRUE;
-            }
-        }
+        return hook_item->HasLegacyCallback(env, callback, IdentityHashCode(env, callback));
     }
-    return JNI_FALSE;
 }
 
 LSP_DEF_NATIVE_METHOD(jboolean, HookBridge, deoptimizeMethod, jobject hookMethod,
@@ -171,11 +1293,66 @@ LSP_DEF_NATIVE_METHOD(jboolean, HookBridge, deoptimizeMethod, jobject hookMethod
 LSP_DEF_NATIVE_METHOD(jobject, HookBridge, invokeOriginalMethod, jobject hookMethod,
                       jobject thiz, jobjectArray args) {
     auto target = env->FromReflectedMethod(hookMethod);
-    HookItem * hook_item = nullptr;
-    hooked_methods.if_contains(target, [&hook_item](const auto &it) {
-        hook_item = it.second.get();
-    });
-    return env->CallObjectMethod(hook_item ? hook_item->GetBackup() : hookMethod, invoke, thiz, args);
+    auto hook_item = FindHookItem(target);
+    if (!hook_item || !hook_item->GetBackup() || !hook_item->BeginOriginal()) {
+        return env->CallObjectMethod(hookMethod, invoke, thiz, args);
+    }
+    auto res = env->CallObjectMethod(hook_item->GetBackup(), invoke, thiz, args);
+    if (hook_item->EndOriginal()) RestoreOriginal(env, hookMethod, target, hook_item);
+    return res;
+}
+
+LSP_DEF_NATIVE_METHOD(jobject, HookBridge, invokeOriginalRaw, jobject hookMethod, jobjectArray args) {
+    auto target = env->FromReflectedMethod(hookMethod);
+    auto hook_item = FindHookItem(target);
+    if (!hook_item || !hook_item->GetBackup() || !hook_item->BeginOriginal()) {
+        // unhooked while this call was on its way in, the target is the original again
+        return InvokeRestoredRaw(env, hookMethod, args);
+    }
+    jobject res = nullptr;
+    const std::string_view shorty = hook_item->shorty;
+    jsize offset = hook_item->is_static ? 0 : 1;
+    jobject thiz = nullptr;
+    std::vector<jvalue> a(shorty.size() - 1);
+    if (env->GetArrayLength(args) != static_cast<jsize>(shorty.size() - 1) + offset) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "args.length != parameters.length");
+    } else if (offset && (thiz = env->GetObjectArrayElement(args, 0)) == nullptr) {
+        env->ThrowNew(env->FindClass("java/lang/NullPointerException"), "this == null");
+    } else if (UnboxArgs(env, shorty, args, offset, a.data())) {
+        res = DispatchOriginal(env, target, *hook_item, thiz, a.data());
+    }
+    if (hook_item->EndOriginal()) RestoreOriginal(env, hookMethod, target, hook_item);
+    return res;
+}
+
+LSP_DEF_NATIVE_METHOD(jobject, HookBridge, invokeHookedOriginal, jobject hookMethod, jobject thiz,
+                      jobjectArray args) {
+    auto target = env->FromReflectedMethod(hookMethod);
+    auto hook_item = FindHookItem(target);
+    if (!hook_item || !hook_item->GetBackup() || !hook_item->BeginOriginal()) {
+        return env->CallObjectMethod(hookMethod, invoke, thiz, args);
+    }
+    jobject res = nullptr;
+    const std::string_view shorty = hook_item->shorty;
+    std::vector<jvalue> a(shorty.size() - 1);
+    if (args == nullptr || env->GetArrayLength(args) != static_cast<jsize>(shorty.size() - 1)) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "args.length != parameters.length");
+    } else if (!hook_item->is_static && thiz == nullptr) {
+        env->ThrowNew(env->FindClass("java/lang/NullPointerException"), "this == null");
+    } else if (!hook_item->is_static && !env->IsInstanceOf(thiz, hook_item->declaring_class)) {
+        env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "this is not an instance of the declaring class");
+    } else if (UnboxArgs(env, shorty, args, 0, a.data(), hook_item->param_types.data())) {
+        res = DispatchOriginal(env, target, *hook_item, hook_item->is_static ? nullptr : thiz, a.data());
+        // what the method threw is told apart from bad arguments like Method.invoke does
+        if (auto *thrown = env->ExceptionOccurred()) {
+            env->ExceptionClear();
+            env->Throw(static_cast<jthrowable>(env->NewObject(invocation_target_exception_class,
+                                                              invocation_target_exception_init, thrown)));
+            env->DeleteLocalRef(thrown);
+        }
+    }
+    if (hook_item->EndOriginal()) RestoreOriginal(env, hookMethod, target, hook_item);
+    return res;
 }
 
 LSP_DEF_NATIVE_METHOD(jobject, HookBridge, allocateObject, jclass cls) {
@@ -184,23 +1361,6 @@ LSP_DEF_NATIVE_METHOD(jobject, HookBridge, allocateObject, jclass cls) {
 
 LSP_DEF_NATIVE_METHOD(jobject, HookBridge, invokeSpecialMethod, jobject method, jcharArray shorty,
                       jclass cls, jobject thiz, jobjectArray args) {
-    static auto* const get_int = env->GetMethodID(env->FindClass("java/lang/Integer"), "intValue", "()I");
-    static auto* const get_double = env->GetMethodID(env->FindClass("java/lang/Double"), "doubleValue", "()D");
-    static auto* const get_long = env->GetMethodID(env->FindClass("java/lang/Long"), "longValue", "()J");
-    static auto* const get_float = env->GetMethodID(env->FindClass("java/lang/Float"), "floatValue", "()F");
-    static auto* const get_short = env->GetMethodID(env->FindClass("java/lang/Short"), "shortValue", "()S");
-    static auto* const get_byte = env->GetMethodID(env->FindClass("java/lang/Byte"), "byteValue", "()B");
-    static auto* const get_char = env->GetMethodID(env->FindClass("java/lang/Character"), "charValue", "()C");
-    static auto* const get_boolean = env->GetMethodID(env->FindClass("java/lang/Boolean"), "booleanValue", "()Z");
-    static auto* const set_int = env->GetStaticMethodID(env->FindClass("java/lang/Integer"), "valueOf", "(I)Ljava/lang/Integer;");
-    static auto* const set_double = env->GetStaticMethodID(env->FindClass("java/lang/Double"), "valueOf", "(D)Ljava/lang/Double;");
-    static auto* const set_long = env->GetStaticMethodID(env->FindClass("java/lang/Long"), "valueOf", "(J)Ljava/lang/Long;");
-    static auto* const set_float = env->GetStaticMethodID(env->FindClass("java/lang/Float"), "valueOf", "(F)Ljava/lang/Float;");
-    static auto* const set_short = env->GetStaticMethodID(env->FindClass("java/lang/Short"), "valueOf", "(S)Ljava/lang/Short;");
-    static auto* const set_byte = env->GetStaticMethodID(env->FindClass("java/lang/Byte"), "valueOf", "(B)Ljava/lang/Byte;");
-    static auto* const set_char = env->GetStaticMethodID(env->FindClass("java/lang/Character"), "valueOf", "(C)Ljava/lang/Character;");
-    static auto* const set_boolean = env->GetStaticMethodID(env->FindClass("java/lang/Boolean"), "valueOf", "(Z)Ljava/lang/Boolean;");
-
     auto target = env->FromReflectedMethod(method);
     auto param_len = env->GetArrayLength(shorty) - 1;
     if (env->GetArrayLength(args) != param_len) {
@@ -211,80 +1371,15 @@ LSP_DEF_NATIVE_METHOD(jobject, HookBridge, invokeSpecialMethod, jobject method,
         env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), "this == null");
         return nullptr;
     }
-    std::vector<jvalue> a(param_len);
+    std::string shorty_str(param_len + 1, 'V');
     auto *const shorty_char = env->GetCharArrayElements(shorty, nullptr);
-    for (jint i = 0; i != param_len; ++i) {
-        jobject element;
-        switch(shorty_char[i + 1]) {
-            case 'I':
-                a[i].i = env->CallIntMethod(element = env->GetObjectArrayElement(args, i), get_int);
-                break;
-            case 'D':
-                a[i].d = env->CallDoubleMethod(element = env->GetObjectArrayElement(args, i), get_double);
-                break;
-            case 'J':
-                a[i].j = env->CallLongMethod(element = env->GetObjectArrayElement(args, i), get_long);
-                break;
-            case 'F':
-                a[i].f = env->CallFloatMethod(element = env->GetObjectArrayElement(args, i), get_float);
-                break;
-            case 'S':
-                a[i].s = env->CallShortMethod(element = env->GetObjectArrayElement(args, i), get_short);
-                break;
-            case 'B':
-                a[i].b = env->CallByteMethod(element = env->GetObjectArrayElement(args, i), get_byte);
-                break;
-            case 'C':
-                a[i].c = env->CallCharMethod(element = env->GetObjectArrayElement(args, i), get_char);
-                break;
-            case 'Z':
-                a[i].z = env->CallBooleanMethod(element = env->GetObjectArrayElement(args, i), get_boolean);
-                break;
-            default:
-            case 'L':
-                a[i].l = env->GetObjectArrayElement(args, i);
-                element = nullptr;
-                break;
-        }
-        if (element) env->DeleteLocalRef(element);
-        if (env->ExceptionCheck()) return nullptr;
-    }
-    jobject value = nullptr;
-    switch(shorty_char[0]) {
-        case 'I':
-            value = env->CallStaticObjectMethod(jclass{nullptr}, set_int, env->CallNonvirtualIntMethodA(thiz, cls, target, a.data()));
-            break;
-        case 'D':
-            value = env->CallStaticObjectMethod(jclass{nullptr}, set_double, env->CallNonvirtualDoubleMethodA(thiz, cls, target, a.data()));
-            break;
-        case 'J':
-            value = env->CallStaticObjectMethod(jclass{nullptr}, set_long, env->CallNonvirtualLongMethodA(thiz, cls, target, a.data()));
-            break;
-        case 'F':
-            value = env->CallStaticObjectMethod(jclass{nullptr}, set_float, env->CallNonvirtualFloatMethodA(thiz, cls, target, a.data()));
-            break;
-        case 'S':
-            value = env->CallStaticObjectMethod(jclass{nullptr}, set_short, env->CallNonvirtualShortMethodA(thiz, cls, target, a.data()));
-            break;
-        case 'B':
-            value = env->CallStaticObjectMethod(jclass{nullptr}, set_byte, env->CallNonvirtualByteMethodA(thiz, cls, target, a.data()));
-            break;
-        case 'C':
-            value = env->CallStaticObjectMethod(jclass{nullptr}, set_char, env->CallNonvirtualCharMethodA(thiz, cls, target, a.data()));
-            break;
-        case 'Z':
-            value = env->CallStaticObjectMethod(jclass{nullptr}, set_boolean, env->CallNonvirtualBooleanMethodA(thiz, cls, target, a.data()));
-            break;
-        case 'L':
-            value = env->CallNonvirtualObjectMethodA(thiz, cls, target, a.data());
-            break;
-        default:
-        case 'V':
-            env->CallNonvirtualVoidMethodA(thiz, cls, target, a.data());
-            break;
+    for (jint i = 0; i <= param_len; ++i) {
+        shorty_str[i] = static_cast<char>(shorty_char[i]);
     }
     env->ReleaseCharArrayElements(shorty, shorty_char, JNI_ABORT);
-    return value;
+    std::vector<jvalue> a(param_len);
+    if (!UnboxArgs(env, shorty_str, args, 0, a.data())) return nullptr;
+    return InvokeAndBox(env, shorty_str[0], thiz, cls, target, a.data());
 }
 
 LSP_DEF_NATIVE_METHOD(jboolean, HookBridge, instanceOf, jobject object, jclass expected_class) {
@@ -295,44 +1390,179 @@ LSP_DEF_NATIVE_METHOD(jboolean, HookBridge, setTrusted, jobject cookie) {
     return lsplant::MakeDexFileTrusted(env, cookie);
 }
 
-LSP_DEF_NATIVE_METHOD(jobjectArray, HookBridge, callbackSnapshot, jclass callback_class, jobject method) {
+LSP_DEF_NATIVE_METHOD(jobjectArray, HookBridge, callbackSnapshot, jclass callback_class, jobject method,
+                      jobjectArray args) {
     auto target = env->FromReflectedMethod(method);
-    HookItem *hook_item = nullptr;
-    hooked_methods.if_contains(target, [&hook_item](const auto &it) {
-        hook_item = it.second.get();
-    });
+    auto hook_item = FindHookItem(target);
     if (!hook_item) return nullptr;
-    jobject backup = hook_item->GetBackup();
-    if (!backup) return nullptr;
-    JNIMonitor monitor(env, backup);
-
-    auto res = env->NewObjectArray(2, env->FindClass("[Ljava/lang/Object;"), nullptr);
-    auto modern = env->NewObjectArray((jsize) hook_item->modern_callbacks.size(), env->FindClass("java/lang/Object"), nullptr);
-    auto legacy = env->NewObjectArray((jsize) hook_item->legacy_callbacks.size(), env->FindClass("java/lang/Object"), nullptr);
-    for (jsize i = 0; auto callback: hook_item->modern_callbacks) {
-        auto before_method = JNI_ToReflectedMethod(env, clazz, callback.second.before_method, JNI_TRUE);
-        auto after_method = JNI_ToReflectedMethod(env, clazz, callback.second.after_method, JNI_TRUE);
-        auto callback_object = JNI_NewObject(env, callback_class, callback_ctor, before_method, after_method);
-        env->SetObjectArrayElement(modern, i++, env->NewLocalRef(callback_object.get()));
-    }
-    for (jsize i = 0; auto callback: hook_item->legacy_callbacks) {
-        env->SetObjectArrayElement(legacy, i++, env->NewLocalRef(callback.second));
-    }
-    env->SetObjectArrayElement(res, 0, modern);
-    env->SetObjectArrayElement(res, 1, legacy);
+    jobject item_monitor = hook_item->GetMonitor();
+    if (!item_monitor) return nullptr;
+    JNIMonitor monitor(env, item_monitor);
+
+    // guards are checked before anything is allocated for the Java dispatch
+    const jsize offset = hook_item->is_static ? 0 : 1;
+    const bool reentered = !dispatching.empty() && dispatching.contains(target);
+    bool not_reentrant = false;
+    std::vector<jobject> legacy_passed;
+    legacy_passed.reserve(hook_item->legacy_callbacks.size());
+    for (const auto &[priority, legacy] : hook_item->legacy_callbacks) {
+        if (legacy.guard) {
+            if (!GuardHolds(env, *legacy.guard, args, offset, reentered)) continue;
+            not_reentrant |= legacy.guard->not_reentrant;
+        }
+        legacy_passed.push_back(legacy.callback);
+    }
+    if (env->ExceptionCheck()) return nullptr;
+    if (hook_item->modern_callbacks.empty() && legacy_passed.empty()) {
+        return static_cast<jobjectArray>(env->NewLocalRef(empty_snapshot));
+    }
+
+    auto *frame = AcquireFrame(env);
+    if (!frame) return nullptr;
+    auto modern = ReuseArray(env, frame->frame, 0, (jsize) hook_item->modern_callbacks.size());
+    auto legacy = ReuseArray(env, frame->frame, 1, (jsize) legacy_passed.size());
+    if (!modern || !legacy) {
+        ReleaseFrame();
+        return nullptr;
+    }
+    for (jsize i = 0; const auto &[priority, callback] : hook_item->modern_callbacks) {
+        env->SetObjectArrayElement(modern.get(), i++, callback.callback);
+    }
+    for (jsize i = 0; auto callback: legacy_passed) {
+        env->SetObjectArrayElement(legacy.get(), i++, callback);
+    }
+    if (env->ExceptionCheck()) {
+        ReleaseFrame();
+        return nullptr;
+    }
+    // NativeHooker calls releaseFrame once done, which also leaves the guarded callbacks
+    frame->target = target;
+    frame->not_reentrant = not_reentrant;
+    if (not_reentrant) ++dispatching[target];
+    return static_cast<jobjectArray>(env->NewLocalRef(frame->frame));
+}
+
+LSP_DEF_NATIVE_METHOD(jobjectArray, HookBridge, getHookedMethods) {
+    std::vector<std::pair<jmethodID, std::shared_ptr<HookItem>>> items;
+    hooked_methods.ForEach([&items](jmethodID target, const std::shared_ptr<HookItem> &item) {
+        items.emplace_back(target, item);
+    });
+    std::vector<ScopedLocalRef<jobject>> methods;
+    for (const auto &[target, item] : items) {
+        // keeps the item from being restored while its declaring class is used
+        if (!item->GetBackup() || !item->BeginOriginal()) continue;
+        auto method = JNI_ToReflectedMethod(env, item->declaring_class, target, item->is_static);
+        if (item->EndOriginal()) RestoreOriginal(env, method.get(), target, item);
+        else methods.emplace_back(std::move(method));
+    }
+    auto res = env->NewObjectArray(static_cast<jsize>(methods.size()),
+                                   env->FindClass("java/lang/reflect/Executable"), nullptr);
+    for (jsize i = 0; const auto &method : methods) {
+        env->SetObjectArrayElement(res, i++, method.get());
+    }
+    return res;
+}
+
+LSP_DEF_NATIVE_METHOD(void, HookBridge, releaseFrame) {
+    ReleaseFrame();
+}
+
+LSP_DEF_NATIVE_METHOD(void, HookBridge, setInstallProfiling, jboolean enabled) {
+    install_profile.SetEnabled(enabled);
+    SetInlineHookTelemetry(enabled);
+}
+
+LSP_DEF_NATIVE_METHOD(jobjectArray, HookBridge, drainInstallProfile) {
+    // one line per new hook: time, result, total and phases in us, method. Then the running call
+    // counts of instrumented native hooks, which are not reset.
+    auto records = install_profile.Drain();
+    auto native_hooks = DumpInlineHookTelemetry();
+    auto res = env->NewObjectArray(static_cast<jsize>(records.size() + native_hooks.size()),
+                                   string_class, nullptr);
+    if (!res) return nullptr;
+    for (jsize i = 0; const auto &r : records) {
+        auto us = [](int64_t ns) { return ns / 1000; };
+        auto line = fmt::format("{} {} total={}us lookup={}us hooker={}us describe={}us trampoline={}us {}",
+                                r.timestamp_ms, r.hooked ? "hooked" : "failed", us(r.total_ns),
+                                us(r.phase_ns[InstallProfile::kLookup]), us(r.phase_ns[InstallProfile::kHooker]),
+                                us(r.phase_ns[InstallProfile::kDescribe]), us(r.phase_ns[InstallProfile::kTrampoline]),
+                                r.method);
+        ScopedLocalRef str(env, env->NewStringUTF(line.c_str()));
+        env->SetObjectArrayElement(res, i++, str.get());
+    }
+    for (auto i = static_cast<jsize>(records.size()); const auto &line : native_hooks) {
+        ScopedLocalRef str(env, env->NewStringUTF(line.c_str()));
+        env->SetObjectArrayElement(res, i++, str.get());
+    }
+    return res;
+}
+
+LSP_DEF_NATIVE_METHOD(jlongArray, HookBridge, getFrameStats) {
+    const jlong stats[] = {static_cast<jlong>(frames_allocated.load(std::memory_order_relaxed)),
+                           static_cast<jlong>(frames_reused.load(std::memory_order_relaxed))};
+    auto res = env->NewLongArray(2);
+    if (res) env->SetLongArrayRegion(res, 0, 2, stats);
     return res;
 }
 
+LSP_DEF_NATIVE_METHOD(jboolean, HookBridge, watchClass, jstring class_name) {
+    if (!ClassWatch::Get(env) || !ClassTableLookup::Get(env)) return JNI_FALSE;
+    auto descriptor = ToDescriptor(JUTFString(env, class_name).get());
+    std::unique_lock lk(watched_classes_lock);
+    if (watched_classes.emplace(std::move(descriptor)).second) {
+        watched_count.fetch_add(1, std::memory_order_release);
+    }
+    return JNI_TRUE;
+}
+
+LSP_DEF_NATIVE_METHOD(jbooleanArray, HookBridge, findDefinedClasses, jobjectArray class_loaders,
+                      jobjectArray class_names) {
+    const auto *lookup = ClassTableLookup::Get(env);
+    auto count = env->GetArrayLength(class_names);
+    auto res = env->NewBooleanArray(count);
+    if (!res || !lookup) return res;
+    std::vector<ClassTableLookup::Query> queries;
+    queries.reserve(count);
+    for (jsize i = 0; i < count; ++i) {
+        ScopedLocalRef loader(env, env->GetObjectArrayElement(class_loaders, i));
+        ScopedLocalRef name(env, static_cast<jstring>(env->GetObjectArrayElement(class_names, i)));
+        queries.push_back(lookup->MakeQuery(env, loader.get(), ToDescriptor(JUTFString(env, name.get()).get())));
+    }
+    auto defined = lookup->AreDefined(queries);
+    std::vector<jboolean> values(defined.begin(), defined.end());
+    env->SetBooleanArrayRegion(res, 0, count, values.data());
+    return res;
+}
+
+LSP_DEF_NATIVE_METHOD(void, HookBridge, unwatchClass, jstring class_name) {
+    auto descriptor = ToDescriptor(JUTFString(env, class_name).get());
+    std::unique_lock lk(watched_classes_lock);
+    if (watched_classes.erase(descriptor)) {
+        watched_count.fetch_sub(1, std::memory_order_release);
+    }
+}
+
 static JNINativeMethod gMethods[] = {
-    LSP_NATIVE_METHOD(HookBridge, hookMethod, "(ZLjava/lang/reflect/Executable;Ljava/lang/Class;ILjava/lang/Object;)Z"),
+    LSP_NATIVE_METHOD(HookBridge, hookMethod, "(ZLjava/lang/reflect/Executable;Ljava/lang/Class;ILjava/lang/Object;Ljava/lang/Object;)Z"),
     LSP_NATIVE_METHOD(HookBridge, unhookMethod, "(ZLjava/lang/reflect/Executable;Ljava/lang/Object;)Z"),
+    LSP_NATIVE_METHOD(HookBridge, isHooked, "(ZLjava/lang/reflect/Executable;Ljava/lang/Object;)Z"),
     LSP_NATIVE_METHOD(HookBridge, deoptimizeMethod, "(Ljava/lang/reflect/Executable;)Z"),
     LSP_NATIVE_METHOD(HookBridge, invokeOriginalMethod, "(Ljava/lang/reflect/Executable;Ljava/lang/Object;[Ljava/lang/Object;)Ljava/lang/Object;"),
+    LSP_NATIVE_METHOD(HookBridge, invokeOriginalRaw, "(Ljava/lang/reflect/Executable;[Ljava/lang/Object;)Ljava/lang/Object;"),
+    LSP_NATIVE_METHOD(HookBridge, invokeHookedOriginal, "(Ljava/lang/reflect/Executable;Ljava/lang/Object;[Ljava/lang/Object;)Ljava/lang/Object;"),
     LSP_NATIVE_METHOD(HookBridge, invokeSpecialMethod, "(Ljava/lang/reflect/Executable;[CLjava/lang/Class;Ljava/lang/Object;[Ljava/lang/Object;)Ljava/lang/Object;"),
     LSP_NATIVE_METHOD(HookBridge, allocateObject, "(Ljava/lang/Class;)Ljava/lang/Object;"),
     LSP_NATIVE_METHOD(HookBridge, instanceOf, "(Ljava/lang/Object;Ljava/lang/Class;)Z"),
     LSP_NATIVE_METHOD(HookBridge, setTrusted, "(Ljava/lang/Object;)Z"),
-    LSP_NATIVE_METHOD(HookBridge, callbackSnapshot, "(Ljava/lang/Class;Ljava/lang/reflect/Executable;)[[Ljava/lang/Object;"),
+    LSP_NATIVE_METHOD(HookBridge, callbackSnapshot, "(Ljava/lang/Class;Ljava/lang/reflect/Executable;[Ljava/lang/Object;)[Ljava/lang/Object;"),
+    LSP_NATIVE_METHOD(HookBridge, releaseFrame, "()V"),
+    LSP_NATIVE_METHOD(HookBridge, getFrameStats, "()[J"),
+    LSP_NATIVE_METHOD(HookBridge, setInstallProfiling, "(Z)V"),
+    LSP_NATIVE_METHOD(HookBridge, drainInstallProfile, "()[Ljava/lang/String;"),
+    LSP_NATIVE_METHOD(HookBridge, getHookedMethods, "()[Ljava/lang/reflect/Executable;"),
+    LSP_NATIVE_METHOD(HookBridge, watchClass, "(Ljava/lang/String;)Z"),
+    LSP_NATIVE_METHOD(HookBridge, findDefinedClasses, "([Ljava/lang/ClassLoader;[Ljava/lang/String;)[Z"),
+    LSP_NATIVE_METHOD(HookBridge, unwatchClass, "(Ljava/lang/String;)V"),
 };
 
 void RegisterHookBridge(JNIEnv *env) {
@@ -340,7 +1570,80 @@ void RegisterHookBridge(JNIEnv *env) {
     invoke = env->GetMethodID(
             method, "invoke",
             "(Ljava/lang/Object;[Ljava/lang/Object;)Ljava/lang/Object;");
+    method_class = static_cast<jclass>(env->NewGlobalRef(method));
+    system_class = static_cast<jclass>(env->NewGlobalRef(JNI_FindClass(env, "java/lang/System").get()));
+    identity_hash_code = JNI_GetStaticMethodID(env, system_class, "identityHashCode", "(Ljava/lang/Object;)I");
+    object_class = static_cast<jclass>(env->NewGlobalRef(JNI_FindClass(env, "java/lang/Object").get()));
+    string_class = static_cast<jclass>(env->NewGlobalRef(JNI_FindClass(env, "java/lang/String").get()));
+    to_string = JNI_GetMethodID(env, object_class, "toString", "()Ljava/lang/String;");
+    {
+        auto empty = env->NewObjectArray(0, object_class, nullptr);
+        auto snapshot = env->NewObjectArray(2, env->GetObjectClass(empty), empty);
+        empty_snapshot = static_cast<jobjectArray>(env->NewGlobalRef(snapshot));
+        env->DeleteLocalRef(snapshot);
+        env->DeleteLocalRef(empty);
+    }
+    invocation_target_exception_class = static_cast<jclass>(env->NewGlobalRef(
+            JNI_FindClass(env, "java/lang/reflect/InvocationTargetException").get()));
+    get_cause = JNI_GetMethodID(env, invocation_target_exception_class, "getCause", "()Ljava/lang/Throwable;");
+    invocation_target_exception_init = JNI_GetMethodID(env, invocation_target_exception_class, "<init>",
+                                                       "(Ljava/lang/Throwable;)V");
+    get_return_type = env->GetMethodID(method, "getReturnType", "()Ljava/lang/Class;");
     env->DeleteLocalRef(method);
+    jclass executable = env->FindClass("java/lang/reflect/Executable");
+    get_parameter_types = env->GetMethodID(executable, "getParameterTypes", "()[Ljava/lang/Class;");
+    get_declaring_class = env->GetMethodID(executable, "getDeclaringClass", "()Ljava/lang/Class;");
+    get_modifiers = env->GetMethodID(executable, "getModifiers", "()I");
+    env->DeleteLocalRef(executable);
+    for (auto &p : primitives) {
+        auto box = JNI_FindClass(env, p.box_class);
+        p.box = static_cast<jclass>(env->NewGlobalRef(box.get()));
+        p.type = static_cast<jclass>(env->NewGlobalRef(JNI_GetStaticObjectField(
+                env, box, JNI_GetStaticFieldID(env, box, "TYPE", "Ljava/lang/Class;")).get()));
+        p.unbox_method = JNI_GetMethodID(env, box, p.unbox_name, p.unbox_sig);
+        p.box_method = JNI_GetStaticMethodID(env, box, "valueOf", p.box_sig);
+    }
+    if (auto hooker = Context::GetInstance()->FindClassFromCurrentLoader(
+            env, "org.lsposed.lspd.impl.LSPosedBridge$NativeHooker")) {
+        native_hooker_class = JNI_NewGlobalRef(env, hooker);
+    } else {
+        LOGE("Failed to find NativeHooker, native Java hooks are unavailable");
+    }
     REGISTER_LSP_NATIVE_METHODS(HookBridge);
 }
+
+std::optional<std::vector<bool>> FindDefinedClasses(JNIEnv *env, jobject class_loader,
+                                                    const std::vector<std::string> &descriptors) {
+    const auto *lookup = ClassTableLookup::Get(env);
+    if (!lookup) return std::nullopt;
+    std::vector<ClassTableLookup::Query> queries;
+    queries.reserve(descriptors.size());
+    for (const auto &descriptor : descriptors) {
+        queries.push_back(lookup->MakeQuery(env, class_loader, descriptor));
+    }
+    return lookup->AreDefined(queries);
+}
+
+int HookJavaMethod(JNIEnv *env, jclass clazz, jmethodID method, NativeJavaHookCallback before,
+                   NativeJavaHookCallback after, void *data) {
+    if (!native_hooker_class || !clazz || !method || (!before && !after)) return -1;
+    auto hook_method = JNI_ToReflectedMethod(env, clazz, method, JNI_FALSE);
+    if (!hook_method) return -1;
+    bool new_hook = false;
+    bool added = AddHookCallback(env, hook_method.get(), native_hooker_class, new_hook, [&](HookItem &hook_item) {
+        hook_item.AddNativeCallback({.before = before, .after = after, .data = data});
+    });
+    if (new_hook) LOGD("Native hook installed on method {}", static_cast<void *>(method));
+    return added ? 0 : -1;
+}
+
+int UnhookJavaMethod(JNIEnv *env, jclass clazz, jmethodID method, NativeJavaHookCallback before,
+                     NativeJavaHookCallback after) {
+    if (!clazz || !method) return -1;
+    auto hook_method = JNI_ToReflectedMethod(env, clazz, method, JNI_FALSE);
+    if (!hook_method) return -1;
+    return RemoveHookCallback(env, hook_method.get(), [&](HookItem &hook_item) {
+        return hook_item.RemoveNativeCallback(before, after);
+    }) ? 0 : -1;
+}
 } // namespace lspd
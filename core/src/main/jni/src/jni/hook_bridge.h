@@ -19,7 +19,23 @@
 #pragma once
 
 #include <jni.h>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "../native_api.h"
 
 namespace lspd {
     void RegisterHookBridge(JNIEnv *env);
+
+    int HookJavaMethod(JNIEnv *env, jclass clazz, jmethodID method, NativeJavaHookCallback before,
+                       NativeJavaHookCallback after, void *data);
+
+    int UnhookJavaMethod(JNIEnv *env, jclass clazz, jmethodID method,
+                         NativeJavaHookCallback before, NativeJavaHookCallback after);
+
+    // Whether each class, given by descriptor, is defined by class_loader or one of its parents,
+    // without defining any. Suspends all threads once; nullopt if class tables cannot be read.
+    std::optional<std::vector<bool>> FindDefinedClasses(JNIEnv *env, jobject class_loader,
+                                                        const std::vector<std::string> &descriptors);
 }
@@ -19,11 +19,22 @@
  */
 
 #include <jni.h>
+#include <parallel_hashmap/phmap.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <vector>
 #include "dex_builder.h"
 #include "framework/androidfw/resource_types.h"
 #include "elf_util.h"
 #include "native_util.h"
 #include "resources_hook.h"
+#include "symbol_cache.h"
 #include "config_bridge.h"
 
 using namespace lsplant;
@@ -45,6 +56,105 @@ namespace lspd {
     static TYPE_RESTART ResXMLParser_restart = nullptr;
     static TYPE_GET_ATTR_NAME_ID ResXMLParser_getAttributeNameID = nullptr;
 
+    // Results of XResources.translateResId and translateAttrId, so that inflating a layout
+    // again does not call back into Java. Both only depend on the resources involved, which
+    // XResources identifies by a key that is never reused. Java invalidates everything when
+    // a replacement set meanwhile may differ from what a cached translation put in place.
+    class TranslationCache {
+        struct AttrEntry {
+            std::u16string name;
+            jint id;
+        };
+
+        std::shared_mutex lock_;
+        // (resources keys, reference in the replacement) -> original id
+        phmap::flat_hash_map<std::pair<jlong, jint>, jint> res_ids_;
+        // (XResources key, hash of the attribute name) -> names and original ids
+        phmap::flat_hash_map<std::pair<jint, size_t>, std::vector<AttrEntry>> attr_ids_;
+
+    public:
+        std::optional<jint> FindResId(jlong key, jint id) {
+            std::shared_lock lk(lock_);
+            if (auto i = res_ids_.find({key, id}); i != res_ids_.end()) return i->second;
+            return std::nullopt;
+        }
+
+        void PutResId(jlong key, jint id, jint translated) {
+            std::unique_lock lk(lock_);
+            res_ids_.try_emplace({key, id}, translated);
+        }
+
+        std::optional<jint> FindAttrId(jint key, std::u16string_view name) {
+            std::shared_lock lk(lock_);
+            auto i = attr_ids_.find({key, std::hash<std::u16string_view>{}(name)});
+            if (i == attr_ids_.end()) return std::nullopt;
+            for (const auto &entry : i->second) {
+                if (entry.name == name) return entry.id;
+            }
+            return std::nullopt;
+        }
+
+        void PutAttrId(jint key, std::u16string_view name, jint translated) {
+            std::unique_lock lk(lock_);
+            auto &entries = attr_ids_[{key, std::hash<std::u16string_view>{}(name)}];
+            for (const auto &entry : entries) {
+                if (entry.name == name) return;
+            }
+            entries.push_back({std::u16string(name), translated});
+        }
+
+        void Clear() {
+            std::unique_lock lk(lock_);
+            res_ids_.clear();
+            attr_ids_.clear();
+        }
+    };
+
+    static TranslationCache translation_cache;
+
+    // What rewriting a replacement XML changed, as (offset into the tree data, new value) pairs.
+    // A layout is parsed from its asset anew whenever it falls out of the XmlBlock cache, so
+    // the same bytes end up patched the same way as long as the translations hold. Cleared
+    // together with the translation cache.
+    class XmlPatchCache {
+    public:
+        struct Patches {
+            size_t size;  // of the tree data, checked before applying
+            std::vector<std::pair<uint32_t, uint32_t>> writes;
+        };
+
+        std::shared_ptr<const Patches> Find(jlong key, jint xml_id) {
+            std::shared_lock lk(lock_);
+            if (auto i = patches_.find({key, xml_id}); i != patches_.end()) {
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return i->second;
+            }
+            misses_.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        void Put(jlong key, jint xml_id, Patches patches) {
+            std::unique_lock lk(lock_);
+            patches_.insert_or_assign({key, xml_id}, std::make_shared<const Patches>(std::move(patches)));
+        }
+
+        void Clear() {
+            std::unique_lock lk(lock_);
+            patches_.clear();
+        }
+
+        uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+        uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+
+    private:
+        std::shared_mutex lock_;
+        phmap::flat_hash_map<std::pair<jlong, jint>, std::shared_ptr<const Patches>> patches_;
+        std::atomic<uint64_t> hits_{0};
+        std::atomic<uint64_t> misses_{0};
+    };
+
+    static XmlPatchCache xml_patch_cache;
+
     static std::string GetXResourcesClassName() {
         auto &obfs_map = ConfigBridge::GetInstance()->obfuscation_map();
         if (obfs_map.empty()) {
@@ -57,32 +167,51 @@ namespace lspd {
         return name;
     }
 
+    // everything resources hooks need from libandroidfw, including the candidates
+    // ResStringPool picks stringAt from
+    static constexpr std::array<std::string_view, 7> kFwSymbols{
+            "_ZN7android12ResXMLParser4nextEv",
+            "_ZN7android12ResXMLParser7restartEv",
+            LP_SELECT("_ZNK7android12ResXMLParser18getAttributeNameIDEj",
+                      "_ZNK7android12ResXMLParser18getAttributeNameIDEm"),
+            "_ZNK7android13ResStringPool8stringAtEj",
+            "_ZNK7android13ResStringPool8stringAtEm",
+            "_ZNK7android13ResStringPool8stringAtEjPj",
+            "_ZNK7android13ResStringPool8stringAtEmPm",
+    };
+
     static bool PrepareSymbols() {
-        SandHook::ElfImg fw(kLibFwName);
-        if (!fw.isValid()) {
-            return false;
-        };
-        if (!(ResXMLParser_next = fw.getSymbAddress<TYPE_NEXT>(
-                "_ZN7android12ResXMLParser4nextEv"))) {
+        // the loader leaves libandroidfw to us, it is parsed once for this and dropped as soon as
+        // the addresses are cached, whether resources get hooked during or after forkCommon
+        static const auto addresses = [] {
+            std::array<void *, kFwSymbols.size()> addresses{};
+            if (auto &fw = GetLibFw(); fw && fw->isValid()) {
+                addresses = fw->getSymbAddresses(kFwSymbols);
+            }
+            GetLibFw(true);
+            return addresses;
+        }();
+        if (!(ResXMLParser_next = reinterpret_cast<TYPE_NEXT>(addresses[0]))) {
             return false;
         }
-        if (!(ResXMLParser_restart = fw.getSymbAddress<TYPE_RESTART>(
-                "_ZN7android12ResXMLParser7restartEv"))) {
+        if (!(ResXMLParser_restart = reinterpret_cast<TYPE_RESTART>(addresses[1]))) {
             return false;
-        };
-        if (!(ResXMLParser_getAttributeNameID = fw.getSymbAddress<TYPE_GET_ATTR_NAME_ID>(
-                LP_SELECT("_ZNK7android12ResXMLParser18getAttributeNameIDEj",
-                          "_ZNK7android12ResXMLParser18getAttributeNameIDEm")))) {
+        }
+        if (!(ResXMLParser_getAttributeNameID = reinterpret_cast<TYPE_GET_ATTR_NAME_ID>(addresses[2]))) {
             return false;
         }
         return android::ResStringPool::setup(InitInfo {
-            .art_symbol_resolver = [&](auto s) {
-                return fw.template getSymbAddress<>(s);
+            .art_symbol_resolver = [&](std::string_view s) -> void * {
+                for (size_t i = 3; i < kFwSymbols.size(); ++i) {
+                    if (kFwSymbols[i] == s) return addresses[i];
+                }
+                return nullptr;
             }
         });
     }
 
     LSP_DEF_NATIVE_METHOD(jboolean, ResourcesHook, initXResourcesNative) {
+        const auto start = std::chrono::steady_clock::now();
         const auto x_resources_class_name = GetXResourcesClassName();
         if (auto classXResources_ = Context::GetInstance()->FindClassFromCurrentLoader(env,
                                                                                        x_resources_class_name)) {
@@ -106,6 +235,8 @@ namespace lspd {
         if (!PrepareSymbols()) {
             return JNI_FALSE;
         }
+        LOGD("initXResourcesNative took {}us", std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count());
         return JNI_TRUE;
     }
 
@@ -117,38 +248,75 @@ namespace lspd {
         return JNI_FALSE;
     }
 
-    LSP_DEF_NATIVE_METHOD(jobject, ResourcesHook, buildDummyClassLoader, jobject parent,
-                          jstring resource_super_class, jstring typed_array_super_class) {
+    // Dex images of the dummy superclasses by (resource superclass, typed array superclass),
+    // generated once per process when the daemon could not hand out its shared copy
+    static std::mutex dummy_dex_lock;
+    static phmap::flat_hash_map<std::pair<std::string, std::string>, std::vector<uint8_t>> dummy_dexes;
+
+    static const std::vector<uint8_t> &GetDummyDex(std::string resource_super_class,
+                                                   std::string typed_array_super_class) {
         using namespace startop::dex;
-        static auto in_memory_classloader = JNI_NewGlobalRef(env, JNI_FindClass(env,
-                                                                                "dalvik/system/InMemoryDexClassLoader"));
-        static jmethodID initMid = JNI_GetMethodID(env, in_memory_classloader, "<init>",
-                                                   "(Ljava/nio/ByteBuffer;Ljava/lang/ClassLoader;)V");
+        std::lock_guard lk(dummy_dex_lock);
+        auto [it, inserted] = dummy_dexes.try_emplace(
+                {std::move(resource_super_class), std::move(typed_array_super_class)});
+        if (!inserted) return it->second;
+
         DexBuilder dex_file;
 
         ClassBuilder xresource_builder{
                 dex_file.MakeClass("xposed.dummy.XResourcesSuperClass")};
-        xresource_builder.setSuperClass(TypeDescriptor::FromClassname(JUTFString(env, resource_super_class).get()));
+        xresource_builder.setSuperClass(TypeDescriptor::FromClassname(it->first.first));
 
         ClassBuilder xtypearray_builder{
                 dex_file.MakeClass("xposed.dummy.XTypedArraySuperClass")};
-        xtypearray_builder.setSuperClass(TypeDescriptor::FromClassname(JUTFString(env, typed_array_super_class).get()));
+        xtypearray_builder.setSuperClass(TypeDescriptor::FromClassname(it->first.second));
 
         slicer::MemView image{dex_file.CreateImage()};
+        auto data = static_cast<const uint8_t *>(image.ptr());
+        it->second.assign(data, data + image.size());
+        return it->second;
+    }
+
+    LSP_DEF_NATIVE_METHOD(jobject, ResourcesHook, buildDummyClassLoader, jobject parent,
+                          jstring resource_super_class, jstring typed_array_super_class) {
+        static auto in_memory_classloader = JNI_NewGlobalRef(env, JNI_FindClass(env,
+                                                                                "dalvik/system/InMemoryDexClassLoader"));
+        static jmethodID initMid = JNI_GetMethodID(env, in_memory_classloader, "<init>",
+                                                   "(Ljava/nio/ByteBuffer;Ljava/lang/ClassLoader;)V");
+        const auto &image = GetDummyDex(JUTFString(env, resource_super_class).get(),
+                                        JUTFString(env, typed_array_super_class).get());
 
-        auto dex_buffer = env->NewDirectByteBuffer(const_cast<void *>(image.ptr()), image.size());
+        // entries are never removed, so the buffer stays valid while ART copies it
+        ScopedLocalRef dex_buffer(env, env->NewDirectByteBuffer(const_cast<uint8_t *>(image.data()),
+                                                                 static_cast<jlong>(image.size())));
         return JNI_NewObject(env, in_memory_classloader, initMid,
                              dex_buffer, parent).release();
     }
 
     LSP_DEF_NATIVE_METHOD(void, ResourcesHook, rewriteXmlReferencesNative,
-                          jlong parserPtr, jobject origRes, jobject repRes) {
+                          jlong parserPtr, jlong translationKey, jint xmlId, jobject origRes, jobject repRes) {
         auto parser = (android::ResXMLParser *) parserPtr;
 
         if (parser == nullptr)
             return;
 
+        // the upper half identifies origRes alone
+        const auto origKey = static_cast<jint>(translationKey >> 32);
+
         const android::ResXMLTree &mTree = parser->mTree;
+        auto data = (uint8_t *) mTree.mHeader;
+        if (auto cached = xml_patch_cache.Find(translationKey, xmlId); cached && cached->size == mTree.mSize) {
+            for (const auto &[offset, value] : cached->writes) {
+                *reinterpret_cast<uint32_t *>(data + offset) = value;
+            }
+            return;
+        }
+        XmlPatchCache::Patches patches{.size = mTree.mSize};
+        auto patch = [&](uint32_t *at, uint32_t value) {
+            *at = value;
+            patches.writes.emplace_back(reinterpret_cast<uint8_t *>(at) - data, value);
+        };
+
         auto mResIds = (uint32_t *) mTree.mResIds;
         android::ResXMLTree_attrExt *tag;
         int attrCount;
@@ -170,16 +338,21 @@ namespace lspd {
                         if (attrNameID >= 0 && (size_t) attrNameID < mTree.mNumResIds &&
                             mResIds[attrNameID] >= 0x7f000000) {
                             auto attrName = mTree.mStrings.stringAt(attrNameID);
-                            jint attrResID = env->CallStaticIntMethod(classXResources,
-                                                                      methodXResourcesTranslateAttrId,
-                                                                      env->NewString(
-                                                                              (const jchar *) attrName.data_,
-                                                                              attrName.length_),
-                                                                      origRes);
-                            if (env->ExceptionCheck())
-                                goto leave;
+                            std::u16string_view name(attrName.data_, attrName.length_);
+                            auto attrResID = translation_cache.FindAttrId(origKey, name);
+                            if (!attrResID) {
+                                ScopedLocalRef nameString(env, env->NewString(
+                                        (const jchar *) attrName.data_, attrName.length_));
+                                attrResID = env->CallStaticIntMethod(classXResources,
+                                                                     methodXResourcesTranslateAttrId,
+                                                                     nameString.get(), origRes);
+                                if (env->ExceptionCheck())
+                                    goto leave;
+                                translation_cache.PutAttrId(origKey, name, *attrResID);
+                            }
 
-                            mResIds[attrNameID] = attrResID;
+                            if (mResIds[attrNameID] != (uint32_t) *attrResID)
+                                patch(&mResIds[attrNameID], *attrResID);
                         }
 
                         // find original resource IDs for reference values (app packages only)
@@ -190,17 +363,25 @@ namespace lspd {
                         if (oldValue < 0x7f000000)
                             continue;
 
-                        jint newValue = env->CallStaticIntMethod(classXResources,
-                                                                 methodXResourcesTranslateResId,
-                                                                 oldValue, origRes, repRes);
-                        if (env->ExceptionCheck())
-                            goto leave;
+                        jint newValue;
+                        if (auto cached = translation_cache.FindResId(translationKey, oldValue)) {
+                            newValue = *cached;
+                        } else {
+                            newValue = env->CallStaticIntMethod(classXResources,
+                                                                methodXResourcesTranslateResId,
+                                                                oldValue, origRes, repRes);
+                            if (env->ExceptionCheck())
+                                goto leave;
+                            translation_cache.PutResId(translationKey, oldValue, newValue);
+                        }
 
                         if (newValue != oldValue)
-                            attr->typedValue.data = newValue;
+                            patch(&attr->typedValue.data, newValue);
                     }
                     continue;
                 case android::ResXMLParser::END_DOCUMENT:
+                    xml_patch_cache.Put(translationKey, xmlId, std::move(patches));
+                    goto leave;
                 case android::ResXMLParser::BAD_DOCUMENT:
                     goto leave;
                 default:
@@ -212,17 +393,32 @@ namespace lspd {
         ResXMLParser_restart(parser);
     }
 
+    LSP_DEF_NATIVE_METHOD(void, ResourcesHook, invalidateTranslations) {
+        translation_cache.Clear();
+        xml_patch_cache.Clear();
+    }
+
+    LSP_DEF_NATIVE_METHOD(jlongArray, ResourcesHook, getXmlPatchStats) {
+        const jlong stats[] = {static_cast<jlong>(xml_patch_cache.hits()),
+                               static_cast<jlong>(xml_patch_cache.misses())};
+        auto res = env->NewLongArray(2);
+        if (res) env->SetLongArrayRegion(res, 0, 2, stats);
+        return res;
+    }
+
     static JNINativeMethod gMethods[] = {
             LSP_NATIVE_METHOD(ResourcesHook, initXResourcesNative, "()Z"),
             LSP_NATIVE_METHOD(ResourcesHook, makeInheritable,"(Ljava/lang/Class;)Z"),
             LSP_NATIVE_METHOD(ResourcesHook, buildDummyClassLoader,
                               "(Ljava/lang/ClassLoader;Ljava/lang/String;Ljava/lang/String;)Ljava/lang/ClassLoader;"),
             LSP_NATIVE_METHOD(ResourcesHook, rewriteXmlReferencesNative,
-                              "(JLandroid/content/res/XResources;Landroid/content/res/Resources;)V")
+                              "(JJILandroid/content/res/XResources;Landroid/content/res/Resources;)V"),
+            LSP_NATIVE_METHOD(ResourcesHook, invalidateTranslations, "()V"),
+            LSP_NATIVE_METHOD(ResourcesHook, getXmlPatchStats, "()[J"),
     };
 
     void RegisterResourcesHook(JNIEnv *env) {
-        auto sign = fmt::format("(JL{};Landroid/content/res/Resources;)V", GetXResourcesClassName());
+        auto sign = fmt::format("(JJIL{};Landroid/content/res/Resources;)V", GetXResourcesClassName());
         gMethods[3].signature = sign.c_str();
 
         REGISTER_LSP_NATIVE_METHODS(ResourcesHook);
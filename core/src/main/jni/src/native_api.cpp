@@ -26,10 +26,24 @@
 #include "logging.h"
 #include "utils/hook_helper.hpp"
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <list>
+#include <mutex>
+#include <string_view>
+#include <vector>
 #include <dlfcn.h>
+#include <fnmatch.h>
+#include <parallel_hashmap/phmap.h>
+#include "copy_on_write.h"
 #include "elf_util.h"
 #include "symbol_cache.h"
+#include "jni/hook_bridge.h"
 
 
 /*
@@ -45,29 +59,328 @@
  * LSP: If any so loaded by target app, we will send a callback to the specific module callback function.
  *      But an exception is, if the target skipped dlopen and handle linker stuffs on their own, the
  *      callback will not work.
+ * Module: Instead of getting every load, it can register callbacks through registerLoadCallback
+ *      together with the libraries they are interested in.
  */
 
 using lsplant::operator""_sym;
 
 namespace lspd {
 
-    std::list<NativeOnModuleLoaded> moduleLoadedCallbacks;
-    std::list<std::string> moduleNativeLibs;
+    // A load callback with its dispatch statistics, one per callback function and never freed
+    struct LoadCallback {
+        explicit LoadCallback(NativeOnModuleLoaded callback) : callback(callback) {}
+
+        const NativeOnModuleLoaded callback;
+        // gets every load, interest filters are skipped then
+        std::atomic<bool> every_load{false};
+        std::atomic<uint64_t> dispatches{0};
+        std::atomic<uint64_t> time_ns{0};
+
+        void Dispatch(const char *name, void *handle) {
+            auto start = std::chrono::steady_clock::now();
+            callback(name, handle);
+            auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start);
+            dispatches.fetch_add(1, std::memory_order_relaxed);
+            time_ns.fetch_add(elapsed.count(), std::memory_order_relaxed);
+        }
+    };
+
+    // What do_dlopen dispatches to. A snapshot is never modified once published, writers copy
+    // it and swap the pointer, so concurrent loads read it without taking a lock.
+    struct NativeRegistry {
+        // registered module libraries by their basename, a dlopen only compares the full names
+        // of those whose basename it shares
+        phmap::flat_hash_map<std::string, std::vector<std::string>> moduleNativeLibs;
+        std::vector<LoadCallback *> moduleLoadedCallbacks;
+        // interest filters of registerLoadCallback by kind of pattern
+        phmap::flat_hash_map<std::string, std::vector<LoadCallback *>> callbacksByBasename;
+        std::vector<std::pair<std::string, LoadCallback *>> callbacksBySuffix;
+        std::vector<std::pair<std::string, LoadCallback *>> callbacksByGlob;
+        phmap::flat_hash_map<NativeOnModuleLoaded, LoadCallback *> records;
+
+        LoadCallback *Record(NativeOnModuleLoaded callback) {
+            auto &record = records[callback];
+            if (!record) record = new LoadCallback(callback);
+            return record;
+        }
+    };
+
+    // a load may still be dispatching from an old snapshot, and since callbacks can dlopen
+    // themselves there is no point after which it is safe to free. There is one per registration,
+    // and the registry itself is never destroyed so that loads racing exit keep theirs.
+    CopyOnWrite<NativeRegistry> &registry = *new CopyOnWrite<NativeRegistry>;
+
     std::unique_ptr<void, std::function<void(void *)>> protected_page(
             mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_SHARED, -1, 0),
             [](void *ptr) { munmap(ptr, 4096); });
 
     const auto[entries] = []() {
         auto *entries = new(protected_page.get()) NativeAPIEntries{
-                .version = 2,
-                .hookFunc = &HookInline,
+                .version = 3,
+                .hookFunc = &HookInlineFromModule,
                 .unhookFunc = &UnhookInline,
+                .hookJavaMethod = &HookJavaMethod,
+                .unhookJavaMethod = &UnhookJavaMethod,
+                .registerLoadCallback = &RegisterLoadCallback,
+                .getLoadCallbackStats = &GetLoadCallbackStats,
+                .hookFuncs = &HookInlineAllOrNothing,
+                .resolveSymbol = &ResolveSymbol,
+                .resolveSymbols = &ResolveSymbols,
+                .resolveSymbolPrefix = &ResolveSymbolPrefix,
         };
 
         mprotect(protected_page.get(), 4096, PROT_READ);
         return std::make_tuple(entries);
     }();
 
+    // ElfImg builds its symtab index lazily and is not safe for concurrent lookups
+    static std::mutex resolver_lock;
+
+    // Inline hooks of modules installed while telemetry is on get a stub in front of their
+    // replacement that atomically counts the calls and jumps on. Only calls are counted: timing
+    // them would take a stub that returns through itself, which needs a shadow stack of return
+    // addresses per thread and breaks on tail calls, longjmp and unwinding through the hook.
+    class InlineHookTelemetry {
+        struct Record {
+            Record(std::string module, std::string symbol)
+                    : module(std::move(module)), symbol(std::move(symbol)) {}
+
+            const std::string module;
+            const std::string symbol;
+            uintptr_t calls = 0;
+        };
+
+        static constexpr size_t kPageSize = 4096;
+        static constexpr size_t kStubSize = 64;
+
+        std::atomic<bool> enabled_{false};
+        std::mutex lock_;
+        // stubs point at their record, so records live as long as the process
+        std::list<Record> records_;
+        // Stubs are carved out of pages mapped twice from one memfd, once writable and once
+        // executable, so writing a new stub never takes a running one out of execution
+        uint8_t *writable_ = nullptr;
+        uint8_t *executable_ = nullptr;
+        size_t used_ = kPageSize;
+
+        static std::string Describe(const void *addr, bool with_symbol) {
+            Dl_info info;
+            if (!dladdr(addr, &info) || !info.dli_fname) return fmt::format("{}", addr);
+            if (!with_symbol) return info.dli_fname;
+            if (info.dli_sname && info.dli_saddr == addr) return info.dli_sname;
+            std::lock_guard lk(resolver_lock);
+            if (auto *img = GetElfImg(info.dli_fname)) {
+                if (auto name = img->getSymbName(addr); !name.empty()) return std::string(name);
+            }
+            return fmt::format("{}+{:#x}", info.dli_fname, reinterpret_cast<uintptr_t>(addr) -
+                                                          reinterpret_cast<uintptr_t>(info.dli_fbase));
+        }
+
+        // Next free stub as its writable and executable address, with lock_ held
+        bool NextSlot(uint8_t **writable, uint8_t **executable) {
+            if (used_ + kStubSize > kPageSize) {
+                int fd = static_cast<int>(syscall(__NR_memfd_create, "lspd-telemetry", MFD_CLOEXEC));
+                if (fd < 0) return false;
+                void *rw = MAP_FAILED, *rx = MAP_FAILED;
+                if (ftruncate(fd, kPageSize) == 0) {
+                    rw = mmap(nullptr, kPageSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                    rx = mmap(nullptr, kPageSize, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+                }
+                close(fd);
+                if (rw == MAP_FAILED || rx == MAP_FAILED) {
+                    if (rw != MAP_FAILED) munmap(rw, kPageSize);
+                    if (rx != MAP_FAILED) munmap(rx, kPageSize);
+                    return false;
+                }
+                writable_ = static_cast<uint8_t *>(rw);
+                executable_ = static_cast<uint8_t *>(rx);
+                used_ = 0;
+            }
+            *writable = writable_ + used_;
+            *executable = executable_ + used_;
+            used_ += kStubSize;
+            return true;
+        }
+
+        // Writes the stub through code, to be run at exec
+        static bool WriteStub(uint8_t *code, const uint8_t *exec, uintptr_t *counter, void *replace) {
+            auto put = [&](size_t at, auto value) { memcpy(code + at, &value, sizeof(value)); };
+#if defined(__aarch64__)
+            put(0, uint32_t{0xF81F0FE0});   // str x0, [sp, #-16]!
+            put(4, uint32_t{0x58000130});   // ldr x16, counter
+            put(8, uint32_t{0xC85F7E11});   // 1: ldxr x17, [x16]
+            put(12, uint32_t{0x91000631});  // add x17, x17, #1
+            put(16, uint32_t{0xC8007E11});  // stxr w0, x17, [x16]
+            put(20, uint32_t{0x35FFFFA0});  // cbnz w0, 1b
+            put(24, uint32_t{0xF84107E0});  // ldr x0, [sp], #16
+            put(28, uint32_t{0x580000B0});  // ldr x16, replace
+            put(32, uint32_t{0xD61F0200});  // br x16
+            put(40, counter);
+            put(48, replace);
+#elif defined(__arm__)
+            put(0, uint32_t{0xE92D0003});   // push {r0, r1}
+            put(4, uint32_t{0xE59FC018});   // ldr r12, counter
+            put(8, uint32_t{0xE19C0F9F});   // 1: ldrex r0, [r12]
+            put(12, uint32_t{0xE2800001});  // add r0, r0, #1
+            put(16, uint32_t{0xE18C1F90});  // strex r1, r0, [r12]
+            put(20, uint32_t{0xE3510000});  // cmp r1, #0
+            put(24, uint32_t{0x1AFFFFFA});  // bne 1b
+            put(28, uint32_t{0xE8BD0003});  // pop {r0, r1}
+            put(32, uint32_t{0xE59FF000});  // ldr pc, replace
+            put(36, counter);
+            put(40, replace);
+#elif defined(__x86_64__)
+            constexpr uint8_t kCode[] = {
+                    0x50,                                      // push rax
+                    0x48, 0x8B, 0x05, 0x10, 0x00, 0x00, 0x00,  // mov rax, [rip + counter]
+                    0xF0, 0x48, 0xFF, 0x00,                    // lock inc qword ptr [rax]
+                    0x58,                                      // pop rax
+                    0xFF, 0x25, 0x0D, 0x00, 0x00, 0x00,        // jmp [rip + replace]
+            };
+            memcpy(code, kCode, sizeof(kCode));
+            put(24, counter);
+            put(32, replace);
+#elif defined(__i386__)
+            code[0] = 0xF0; code[1] = 0xFF; code[2] = 0x05;  // lock inc dword ptr [counter]
+            put(3, counter);
+            code[7] = 0xFF; code[8] = 0x25;                  // jmp [replace]
+            put(9, reinterpret_cast<uintptr_t>(exec + 16));
+            put(16, replace);
+#else
+            return false;
+#endif
+            return true;
+        }
+
+        void *MakeStub(uintptr_t *counter, void *replace) {
+            uint8_t *code, *exec;
+            {
+                std::lock_guard lk(lock_);
+                if (!NextSlot(&code, &exec)) return nullptr;
+            }
+            if (!WriteStub(code, exec, counter, replace)) return nullptr;
+            __builtin___clear_cache(reinterpret_cast<char *>(exec), reinterpret_cast<char *>(exec + kStubSize));
+            return exec;
+        }
+
+    public:
+        void SetEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+
+        // Returns what to install instead of replace
+        void *Wrap(const void *caller, void *target, void *replace) {
+            if (!enabled_.load(std::memory_order_relaxed)) return replace;
+            auto module = Describe(caller, false);
+            auto symbol = Describe(target, true);
+            Record *record;
+            {
+                std::lock_guard lk(lock_);
+                record = &records_.emplace_back(std::move(module), std::move(symbol));
+            }
+            auto *stub = MakeStub(&record->calls, replace);
+            if (!stub) {
+                LOGW("native_api: no telemetry stub for {}", record->symbol);
+                return replace;
+            }
+            return stub;
+        }
+
+        std::vector<std::string> Dump() {
+            std::lock_guard lk(lock_);
+            std::vector<std::string> lines;
+            lines.reserve(records_.size());
+            for (const auto &record : records_) {
+                auto calls = __atomic_load_n(&record.calls, __ATOMIC_RELAXED);
+                lines.emplace_back(fmt::format("native {} {} calls={}", record.module, record.symbol, calls));
+            }
+            return lines;
+        }
+    } inline_hook_telemetry;
+
+    void SetInlineHookTelemetry(bool enabled) {
+        inline_hook_telemetry.SetEnabled(enabled);
+    }
+
+    std::vector<std::string> DumpInlineHookTelemetry() {
+        return inline_hook_telemetry.Dump();
+    }
+
+    static int HookInlineFrom(const void *caller, void *original, void *replace, void **backup) {
+        return HookInline(original, inline_hook_telemetry.Wrap(caller, original, replace), backup);
+    }
+
+    [[gnu::noinline]] int HookInlineFromModule(void *original, void *replace, void **backup) {
+        return HookInlineFrom(__builtin_return_address(0), original, replace, backup);
+    }
+
+    [[gnu::noinline]] int HookInlineAllOrNothing(NativeHookTarget *targets, size_t count) {
+        if (!targets && count) return -1;
+        const auto *caller = __builtin_return_address(0);
+        // sorted only to find duplicates, each target is still hooked on its own
+        std::vector<size_t> order(count);
+        for (size_t i = 0; i < count; ++i) {
+            if (!targets[i].func || !targets[i].replace) return -1;
+            order[i] = i;
+        }
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return targets[a].func < targets[b].func;
+        });
+        for (size_t i = 1; i < count; ++i) {
+            if (targets[order[i]].func == targets[order[i - 1]].func) return -1;
+        }
+        for (size_t i = 0; i < count; ++i) {
+            auto &target = targets[order[i]];
+            void *backup = nullptr;
+            if (HookInlineFrom(caller, target.func, target.replace, &backup) == 0) {
+                if (target.backup) *target.backup = backup;
+                continue;
+            }
+            LOGW("native_api: hookFuncs failed at {}, rolling back {} hooks", target.func, i);
+            for (size_t j = i; j-- > 0;) {
+                auto &installed = targets[order[j]];
+                UnhookInline(installed.func);
+                if (installed.backup) *installed.backup = nullptr;
+            }
+            return static_cast<int>(order[i]) + 1;
+        }
+        return 0;
+    }
+
+    void *ResolveSymbol(const char *library, const char *symbol) {
+        if (!library || !symbol) return nullptr;
+        std::lock_guard lk(resolver_lock);
+        auto *img = GetElfImg(library);
+        return img ? img->getSymbAddress(symbol) : nullptr;
+    }
+
+    size_t ResolveSymbols(const char *library, const char *const *symbols, void **addresses,
+                          size_t count) {
+        if (!library || !symbols || !addresses) return 0;
+        std::lock_guard lk(resolver_lock);
+        auto *img = GetElfImg(library);
+        size_t found = 0;
+        for (size_t i = 0; i < count; ++i) {
+            addresses[i] = img && symbols[i] ? img->getSymbAddress(symbols[i]) : nullptr;
+            if (addresses[i]) ++found;
+        }
+        return found;
+    }
+
+    void *ResolveSymbolPrefix(const char *library, const char *prefix) {
+        if (!library || !prefix) return nullptr;
+        std::lock_guard lk(resolver_lock);
+        auto *img = GetElfImg(library);
+        return img ? img->getSymbPrefixFirstAddress(prefix) : nullptr;
+    }
+
+    static std::string_view Basename(std::string_view path) {
+        if (auto slash = path.rfind('/'); slash != std::string_view::npos) {
+            return path.substr(slash + 1);
+        }
+        return path;
+    }
+
     void RegisterNativeLib(const std::string &library_name) {
         static bool initialized = []() {
             return InstallNativeAPI(lsplant::InitInfo {
@@ -82,7 +395,9 @@ namespace lspd {
         }();
         if (!initialized) [[unlikely]] return;
         LOGD("native_api: Registered {}", library_name);
-        moduleNativeLibs.push_back(library_name);
+        registry.Update([&](NativeRegistry &next) {
+            next.moduleNativeLibs[std::string(Basename(library_name))].push_back(library_name);
+        });
     }
 
     bool hasEnding(std::string_view fullString, std::string_view ending) {
@@ -93,23 +408,78 @@ namespace lspd {
         return false;
     }
 
+    int RegisterLoadCallback(NativeOnModuleLoaded callback, const char *const *patterns, size_t count) {
+        if (!callback || (!patterns && count)) return -1;
+        registry.Update([&](NativeRegistry &next) {
+            auto *record = next.Record(callback);
+            for (size_t i = 0; i < count; ++i) {
+                if (!patterns[i] || !*patterns[i]) continue;
+                std::string pattern(patterns[i]);
+                if (pattern.find_first_of("*?[") != std::string::npos) {
+                    next.callbacksByGlob.emplace_back(std::move(pattern), record);
+                } else if (pattern.find('/') != std::string::npos) {
+                    next.callbacksBySuffix.emplace_back(std::move(pattern), record);
+                } else {
+                    next.callbacksByBasename[std::move(pattern)].push_back(record);
+                }
+            }
+        });
+        return 0;
+    }
+
+    int GetLoadCallbackStats(NativeOnModuleLoaded callback, uint64_t *dispatches, uint64_t *time_ns) {
+        const auto &records = registry.Load().records;
+        auto record = records.find(callback);
+        if (record == records.end()) return -1;
+        if (dispatches) *dispatches = record->second->dispatches.load(std::memory_order_relaxed);
+        if (time_ns) *time_ns = record->second->time_ns.load(std::memory_order_relaxed);
+        return 0;
+    }
+
+    static void DispatchLoaded(const NativeRegistry &current, const char *name, void *handle) {
+        for (auto *callback: current.moduleLoadedCallbacks) {
+            callback->Dispatch(name, handle);
+        }
+        if (!name) return;
+        std::string_view path(name);
+        auto base = Basename(path);
+        std::vector<LoadCallback *> interested;
+        auto add = [&](LoadCallback *callback) {
+            if (callback->every_load.load(std::memory_order_relaxed)) return;
+            if (std::find(interested.begin(), interested.end(), callback) != interested.end()) return;
+            interested.push_back(callback);
+        };
+        if (auto i = current.callbacksByBasename.find(base); i != current.callbacksByBasename.end()) {
+            for (auto *callback: i->second) add(callback);
+        }
+        for (const auto &[suffix, callback]: current.callbacksBySuffix) {
+            if (hasEnding(path, suffix)) add(callback);
+        }
+        for (const auto &[glob, callback]: current.callbacksByGlob) {
+            // base is the tail of name, so it is null terminated as well
+            const char *subject = glob.find('/') != std::string::npos ? name : base.data();
+            if (fnmatch(glob.c_str(), subject, 0) == 0) add(callback);
+        }
+        for (auto *callback: interested) {
+            callback->Dispatch(name, handle);
+        }
+    }
+
     inline static auto do_dlopen_ = "__dl__Z9do_dlopenPKciPK17android_dlextinfoPKv"_sym.hook->*[]
 		<lsplant::Backup auto backup>
 		(const char* name, int flags, const void* extinfo, const void* caller_addr) static -> void* {
                 auto *handle = backup(name, flags, extinfo, caller_addr);
-                std::string ns;
-                if (name) {
-                    ns = std::string(name);
-                } else {
-                    ns = "NULL";
-                }
-                LOGD("native_api: do_dlopen({})", ns);
+                LOGD("native_api: do_dlopen({})", name ? name : "NULL");
                 if (handle == nullptr) {
                     return handle;
                 }
-                for (std::string_view module_lib: moduleNativeLibs) {
-                    // the so is a module so
-                    if (hasEnding(ns, module_lib)) [[unlikely]] {
+                const auto &current = registry.Load();
+                const auto &libs_by_name = current.moduleNativeLibs;
+                auto libs = name ? libs_by_name.find(Basename(name)) : libs_by_name.end();
+                if (libs != libs_by_name.end()) [[unlikely]] {
+                    for (std::string_view module_lib: libs->second) {
+                        // the so is a module so
+                        if (!hasEnding(name, module_lib)) continue;
                         LOGD("Loading module native library {}", module_lib);
                         void *native_init_sym = dlsym(handle, "native_init");
                         if (native_init_sym == nullptr) [[unlikely]] {
@@ -120,7 +490,12 @@ namespace lspd {
                         auto native_init = reinterpret_cast<NativeInit>(native_init_sym);
                         auto *callback = native_init(entries);
                         if (callback) {
-                            moduleLoadedCallbacks.push_back(callback);
+                            registry.Update([&](NativeRegistry &next) {
+                                auto *record = next.Record(callback);
+                                if (!record->every_load.exchange(true)) {
+                                    next.moduleLoadedCallbacks.push_back(record);
+                                }
+                            });
                             // return directly to avoid module interaction
                             return handle;
                         }
@@ -128,9 +503,7 @@ namespace lspd {
                 }
 
                 // Callbacks
-                for (auto &callback: moduleLoadedCallbacks) {
-                    callback(name, handle);
-                }
+                DispatchLoaded(current, name, handle);
                 return handle;
             };
 
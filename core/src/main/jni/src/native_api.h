@@ -27,7 +27,9 @@
 
 #include <cstdint>
 #include <dlfcn.h>
+#include <jni.h>
 #include <string>
+#include <vector>
 #include <dobby.h>
 
 #include "config.h"
@@ -39,10 +41,89 @@ typedef int (*UnhookFunType)(void *func);
 
 typedef void (*NativeOnModuleLoaded)(const char *name, void *handle);
 
+typedef struct {
+    void *func;
+    void *replace;
+    void **backup;
+} NativeHookTarget;
+
+/*
+ * All-or-nothing sequential hooking: hooks the targets one after another, each with its own
+ * permission change and cache flush as hookFunc does, and unhooks them again if one fails.
+ * Other threads may see some targets hooked until then. Returns 0 on success, -1 if a target is
+ * null or appears twice, or the index of the failing target plus one. Backups of hooks removed
+ * again are reset to null.
+ */
+typedef int (*HookFuncsType)(NativeHookTarget *targets, size_t count);
+
+/*
+ * Passed to native callbacks of a hooked Java method. Native callbacks run innermost, right
+ * around the original method, in registration order for before and reversed for after.
+ * A before callback may set skip_original together with result or throwable. After callbacks
+ * see (and may replace) result and throwable. Callbacks must not return with a pending exception.
+ */
+typedef struct {
+    JNIEnv *env;
+    jmethodID method;
+    jobject thiz;           // null for static methods
+    jvalue *args;           // may be modified in place by before callbacks
+    jvalue result;
+    jthrowable throwable;
+    jboolean skip_original;
+    void *data;             // as passed to hookJavaMethod
+} NativeJavaHookParam;
+
+typedef void (*NativeJavaHookCallback)(NativeJavaHookParam *param);
+
+typedef int (*HookJavaFunType)(JNIEnv *env, jclass clazz, jmethodID method,
+                               NativeJavaHookCallback before, NativeJavaHookCallback after,
+                               void *data);
+
+typedef int (*UnhookJavaFunType)(JNIEnv *env, jclass clazz, jmethodID method,
+                                 NativeJavaHookCallback before, NativeJavaHookCallback after);
+
+/*
+ * Registers callback for the loads matching any of patterns only. A pattern without a slash is
+ * compared with the basename of the loaded library, one with a slash must match the end of its
+ * path. Patterns containing *, ? or [ are globs (fnmatch) over the basename or, if they contain
+ * a slash, over the whole path. A callback gets each load at most once.
+ */
+typedef int (*RegisterLoadCallbackFunType)(NativeOnModuleLoaded callback,
+                                           const char *const *patterns, size_t count);
+
+/*
+ * How often callback was called for a load and how long it took in total, for any callback
+ * the framework dispatches to. Returns -1 for an unknown callback.
+ */
+typedef int (*GetLoadCallbackStatsFunType)(NativeOnModuleLoaded callback, uint64_t *dispatches,
+                                           uint64_t *time_ns);
+
+/*
+ * Symbol lookups served from the framework's parsed images, including non-exported symbols.
+ * library is a name as it appears in /proc/self/maps, e.g. "libart.so". resolveSymbols fills
+ * addresses (null where not found) and returns how many were found. resolveSymbolPrefix returns
+ * the first symbol, in name order, starting with prefix.
+ */
+typedef void *(*ResolveSymbolFunType)(const char *library, const char *symbol);
+
+typedef size_t (*ResolveSymbolsFunType)(const char *library, const char *const *symbols,
+                                        void **addresses, size_t count);
+
+typedef void *(*ResolveSymbolPrefixFunType)(const char *library, const char *prefix);
+
 typedef struct {
     uint32_t version;
     HookFunType hookFunc;
     UnhookFunType unhookFunc;
+    // since version 3
+    HookJavaFunType hookJavaMethod;
+    UnhookJavaFunType unhookJavaMethod;
+    RegisterLoadCallbackFunType registerLoadCallback;
+    GetLoadCallbackStatsFunType getLoadCallbackStats;
+    HookFuncsType hookFuncs;
+    ResolveSymbolFunType resolveSymbol;
+    ResolveSymbolsFunType resolveSymbols;
+    ResolveSymbolPrefixFunType resolveSymbolPrefix;
 } NativeAPIEntries;
 
 typedef NativeOnModuleLoaded (*NativeInit)(const NativeAPIEntries *entries);
@@ -52,6 +133,10 @@ namespace lspd {
 
     void RegisterNativeLib(const std::string &library_name);
 
+    int RegisterLoadCallback(NativeOnModuleLoaded callback, const char *const *patterns, size_t count);
+
+    int GetLoadCallbackStats(NativeOnModuleLoaded callback, uint64_t *dispatches, uint64_t *time_ns);
+
     inline int HookInline(void *original, void *replace, void **backup) {
         if constexpr (isDebug) {
             Dl_info info;
@@ -75,6 +160,23 @@ namespace lspd {
         }
         return DobbyDestroy(original);
     }
+
+    // hookFunc and hookFuncs as handed to modules, instrumented while telemetry is on
+    int HookInlineFromModule(void *original, void *replace, void **backup);
+
+    int HookInlineAllOrNothing(NativeHookTarget *targets, size_t count);
+
+    void SetInlineHookTelemetry(bool enabled);
+
+    // one line per instrumented hook: module, target symbol and call count
+    std::vector<std::string> DumpInlineHookTelemetry();
+
+    void *ResolveSymbol(const char *library, const char *symbol);
+
+    size_t ResolveSymbols(const char *library, const char *const *symbols, void **addresses,
+                          size_t count);
+
+    void *ResolveSymbolPrefix(const char *library, const char *prefix);
 }
 
 #endif //LSPOSED_NATIVE_API_H
@@ -26,8 +26,11 @@
 #include "elf_util.h"
 #include "macros.h"
 #include "config.h"
+#include <mutex>
+#include <string>
 #include <vector>
 #include <logging.h>
+#include <parallel_hashmap/phmap.h>
 
 namespace lspd {
     std::unique_ptr<const SandHook::ElfImg> &GetArt(bool release) {
@@ -50,6 +53,16 @@ namespace lspd {
         return kImg;
     }
 
+    std::unique_ptr<const SandHook::ElfImg> &GetLibFw(bool release) {
+        static std::unique_ptr<const SandHook::ElfImg> kImg = nullptr;
+        if (release) {
+            kImg.reset();
+        } else if (!kImg) {
+            kImg = std::make_unique<SandHook::ElfImg>(kLibFwName);
+        }
+        return kImg;
+    }
+
     std::unique_ptr<const SandHook::ElfImg> &GetLinker(bool release) {
         static std::unique_ptr<const SandHook::ElfImg> kImg = nullptr;
         if (release) {
@@ -59,4 +72,19 @@ namespace lspd {
         }
         return kImg;
     }
+
+    const SandHook::ElfImg *GetElfImg(std::string_view name) {
+        // images of their own rather than the ones above, which the loader releases once the
+        // process is set up; a handful of libraries is all modules look into
+        static constexpr size_t kMaxImgs = 8;
+        static std::mutex lock;
+        static phmap::flat_hash_map<std::string, std::unique_ptr<const SandHook::ElfImg>> kImgs;
+        std::lock_guard lk(lock);
+        if (auto i = kImgs.find(name); i != kImgs.end()) return i->second.get();
+        auto loaded = std::make_unique<SandHook::ElfImg>(name);
+        // not cached while the library is not loaded, it may be later
+        if (!loaded->isValid()) return nullptr;
+        if (kImgs.size() >= kMaxImgs) kImgs.erase(kImgs.begin());
+        return kImgs.emplace(name, std::move(loaded)).first->second.get();
+    }
 }  // namespace lspd
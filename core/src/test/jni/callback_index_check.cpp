@@ -0,0 +1,174 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+// The legacy callback index of HookItem in hook_bridge.cpp, with IsSameObject replaced by a
+// counted comparison. Checks it against a plain list under colliding identity hashes: a callback
+// is held at most once, unhook removes exactly that callback and priority order is kept.
+// With --bench, hooks and unhooks 10k callbacks of one method against the linear scan it replaced.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+using jint = int32_t;
+struct _object;
+using jobject = _object *;
+
+uint64_t same_object_calls = 0;
+
+// a JNI call on the device, never inlined here either
+[[gnu::noinline]] bool IsSameObject(jobject a, jobject b) {
+    ++same_object_calls;
+    return a == b;
+}
+
+// What HookItem did before, one IsSameObject per registered callback on unhook
+struct ScannedCallbacks {
+    std::multimap<jint, jobject, std::greater<>> legacy_callbacks;
+
+    bool AddLegacyCallback(jint priority, jobject callback, jint) {
+        legacy_callbacks.emplace(priority, callback);
+        return true;
+    }
+
+    bool RemoveLegacyCallback(jobject callback, jint) {
+        for (auto i = legacy_callbacks.begin(); i != legacy_callbacks.end(); ++i) {
+            if (IsSameObject(i->second, callback)) {
+                legacy_callbacks.erase(i);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+struct IndexedCallbacks {
+    std::multimap<jint, jobject, std::greater<>> legacy_callbacks;
+    std::unordered_multimap<jint, decltype(legacy_callbacks)::iterator> legacy_index;
+
+    auto FindLegacy(jobject callback, jint identity) {
+        auto [begin, end] = legacy_index.equal_range(identity);
+        for (auto i = begin; i != end; ++i) {
+            if (IsSameObject(i->second->second, callback)) return i;
+        }
+        return legacy_index.end();
+    }
+
+    bool AddLegacyCallback(jint priority, jobject callback, jint identity) {
+        if (FindLegacy(callback, identity) != legacy_index.end()) return false;
+        legacy_index.emplace(identity, legacy_callbacks.emplace(priority, callback));
+        return true;
+    }
+
+    bool RemoveLegacyCallback(jobject callback, jint identity) {
+        auto i = FindLegacy(callback, identity);
+        if (i == legacy_index.end()) return false;
+        legacy_callbacks.erase(i->second);
+        legacy_index.erase(i);
+        return true;
+    }
+};
+
+jobject Object(size_t i) { return reinterpret_cast<jobject>((i + 1) * 16); }
+
+int Check() {
+    constexpr size_t kObjects = 512;
+    // identityHashCode is far from unique, here every hash is shared by 32 objects
+    auto identity = [](size_t i) { return static_cast<jint>(i % 16); };
+    std::mt19937 rng(1);
+    std::vector<jint> priority(kObjects);
+    for (auto &p : priority) p = static_cast<jint>(rng() % 8);
+    IndexedCallbacks indexed;
+    // registration order of the held callbacks
+    std::vector<size_t> held;
+    for (int round = 0; round < 200000; ++round) {
+        auto i = rng() % kObjects;
+        bool present = std::find(held.begin(), held.end(), i) != held.end();
+        if (rng() % 2) {
+            if (indexed.AddLegacyCallback(priority[i], Object(i), identity(i)) == present) {
+                std::fprintf(stderr, "FAILED: hooking %s callback\n", present ? "a held" : "a new");
+                return EXIT_FAILURE;
+            }
+            if (!present) held.push_back(i);
+        } else {
+            if (indexed.RemoveLegacyCallback(Object(i), identity(i)) != present) {
+                std::fprintf(stderr, "FAILED: unhooking %s callback\n", present ? "a held" : "a missing");
+                return EXIT_FAILURE;
+            }
+            std::erase(held, i);
+        }
+    }
+    // callbacks run by descending priority, in registration order within one
+    std::stable_sort(held.begin(), held.end(), [&](size_t a, size_t b) { return priority[a] > priority[b]; });
+    std::vector<jobject> expected, actual;
+    for (auto i : held) expected.push_back(Object(i));
+    for (const auto &[p, callback] : indexed.legacy_callbacks) actual.push_back(callback);
+    if (expected != actual || indexed.legacy_index.size() != held.size()) {
+        std::fprintf(stderr, "FAILED: callbacks out of priority order or index out of sync\n");
+        return EXIT_FAILURE;
+    }
+    std::printf("callback index: %zu callbacks held after 200000 hooks and unhooks\n", held.size());
+    return EXIT_SUCCESS;
+}
+
+template<typename Callbacks>
+void HookAndUnhook(size_t count, const char *what) {
+    std::mt19937 rng(2);
+    std::vector<jint> priority(count), identity(count);
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i) {
+        priority[i] = static_cast<jint>(rng() % 100);
+        // the 25 hash bits ART keeps in the lock word
+        identity[i] = static_cast<jint>(rng() & 0x1ffffff);
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), rng);
+    Callbacks callbacks;
+    same_object_calls = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; ++i) callbacks.AddLegacyCallback(priority[i], Object(i), identity[i]);
+    for (auto i : order) callbacks.RemoveLegacyCallback(Object(i), identity[i]);
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start);
+    std::printf("%-8s %10.2f ms  %12llu IsSameObject\n", what, elapsed.count(),
+                static_cast<unsigned long long>(same_object_calls));
+}
+
+int Bench() {
+    constexpr size_t kCallbacks = 10000;
+    std::printf("hook and unhook %zu callbacks of one method\n", kCallbacks);
+    HookAndUnhook<ScannedCallbacks>(kCallbacks, "scan");
+    HookAndUnhook<IndexedCallbacks>(kCallbacks, "index");
+    return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc > 1 && std::strcmp(argv[1], "--bench") == 0) return Bench();
+    return Check();
+}
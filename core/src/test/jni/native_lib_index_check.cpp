@@ -0,0 +1,174 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+// The module library lookup of the do_dlopen hook in native_api.cpp, with std::unordered_map in
+// place of phmap. Checks that indexing by basename matches what the suffix scan it replaced
+// matched, except for bare suffixes that do not start at a path separator.
+// With --bench, times both for the loads of a typical app start.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+bool hasEnding(std::string_view fullString, std::string_view ending) {
+    if (fullString.length() >= ending.length()) {
+        return (0 == fullString.compare(fullString.length() - ending.length(), ending.length(),
+                                        ending));
+    }
+    return false;
+}
+
+std::string_view Basename(std::string_view path) {
+    if (auto slash = path.rfind('/'); slash != std::string_view::npos) {
+        return path.substr(slash + 1);
+    }
+    return path;
+}
+
+// What do_dlopen did before, a copy of the name and a suffix check against every library
+struct ScannedLibs {
+    std::list<std::string> moduleNativeLibs;
+
+    void Register(const std::string &library_name) { moduleNativeLibs.push_back(library_name); }
+
+    const std::string *Find(const char *name) {
+        std::string ns = name ? std::string(name) : "NULL";
+        for (const auto &module_lib: moduleNativeLibs) {
+            if (hasEnding(ns, module_lib)) return &module_lib;
+        }
+        return nullptr;
+    }
+};
+
+struct IndexedLibs {
+    std::unordered_map<std::string_view, std::vector<std::string>> moduleNativeLibs;
+    std::list<std::string> basenames;
+
+    void Register(const std::string &library_name) {
+        auto base = Basename(library_name);
+        auto i = moduleNativeLibs.find(base);
+        if (i == moduleNativeLibs.end()) {
+            i = moduleNativeLibs.emplace(basenames.emplace_back(base), std::vector<std::string>{}).first;
+        }
+        i->second.push_back(library_name);
+    }
+
+    const std::string *Find(const char *name) {
+        auto libs = name ? moduleNativeLibs.find(Basename(name)) : moduleNativeLibs.end();
+        if (libs == moduleNativeLibs.end()) return nullptr;
+        for (const auto &module_lib: libs->second) {
+            if (hasEnding(name, module_lib)) return &module_lib;
+        }
+        return nullptr;
+    }
+};
+
+// what modules list in assets/native_init
+std::vector<std::string> ModuleLibs() {
+    std::vector<std::string> libs;
+    for (int m = 0; m < 24; ++m) libs.push_back("libmodule" + std::to_string(m) + ".so");
+    libs.emplace_back("arm64-v8a/libnested.so");
+    libs.emplace_back("foo.so");
+    return libs;
+}
+
+// roughly what an app start dlopens, a few of them module libraries
+std::vector<std::string> Loads() {
+    std::vector<std::string> loads;
+    for (int i = 0; i < 300; ++i) loads.push_back("/system/lib64/libsystem" + std::to_string(i) + ".so");
+    for (int i = 0; i < 60; ++i) {
+        loads.push_back("/data/app/~~Zm9v==/com.example-YmFy==/lib/arm64/libapp" + std::to_string(i) + ".so");
+    }
+    for (int m = 0; m < 24; m += 3) {
+        loads.push_back("/data/app/~~bW9k==/org.module" + std::to_string(m) + "-==/lib/arm64/libmodule" +
+                        std::to_string(m) + ".so");
+    }
+    loads.emplace_back("/data/app/~~bW9k==/org.nested-==/lib/arm64-v8a/libnested.so");
+    loads.emplace_back("/data/app/~~bW9k==/org.nested-==/lib/x86/libnested.so");
+    loads.emplace_back("/vendor/lib64/libfoo.so");
+    loads.emplace_back("/vendor/lib64/foo.so");
+    loads.emplace_back("libmodule1.so");
+    return loads;
+}
+
+int Check() {
+    ScannedLibs scanned;
+    IndexedLibs indexed;
+    for (const auto &lib: ModuleLibs()) {
+        scanned.Register(lib);
+        indexed.Register(lib);
+    }
+    size_t matched = 0;
+    for (const auto &load: Loads()) {
+        auto *before = scanned.Find(load.c_str());
+        auto *after = indexed.Find(load.c_str());
+        // a registered name now has to be the whole path or start after a separator
+        bool whole = before && (before->size() == load.size() || load[load.size() - before->size() - 1] == '/');
+        if ((after != nullptr) != whole || (after && *after != *before)) {
+            std::fprintf(stderr, "FAILED: %s matched %s before and %s after\n", load.c_str(),
+                         before ? before->c_str() : "nothing", after ? after->c_str() : "nothing");
+            return EXIT_FAILURE;
+        }
+        matched += after != nullptr;
+    }
+    if (indexed.Find(nullptr) || !indexed.Find("/vendor/lib64/foo.so") || indexed.Find("/vendor/lib64/libfoo.so")) {
+        std::fprintf(stderr, "FAILED: bare suffix or null name\n");
+        return EXIT_FAILURE;
+    }
+    std::printf("native lib index: %zu of %zu loads matched a module library\n", matched, Loads().size());
+    return EXIT_SUCCESS;
+}
+
+template<typename Libs>
+void Time(const char *what) {
+    constexpr int kRounds = 2000;
+    Libs libs;
+    for (const auto &lib: ModuleLibs()) libs.Register(lib);
+    auto loads = Loads();
+    size_t matched = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int round = 0; round < kRounds; ++round) {
+        for (const auto &load: loads) matched += libs.Find(load.c_str()) != nullptr;
+    }
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start);
+    std::printf("%-8s %8.1f ns per dlopen  (%zu matched)\n", what,
+                elapsed.count() / kRounds / static_cast<double>(loads.size()), matched / kRounds);
+}
+
+int Bench() {
+    std::printf("%zu module libraries, %zu loads\n", ModuleLibs().size(), Loads().size());
+    Time<ScannedLibs>("scan");
+    Time<IndexedLibs>("index");
+    return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc > 1 && std::strcmp(argv[1], "--bench") == 0) return Bench();
+    return Check();
+}
@@ -0,0 +1,198 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+// Hooks and unhooks from several threads while others dispatch, the way hook_bridge uses
+// RcuMap for hooked_methods. Any item a lookup returns must still be the live item of its key.
+// With --bench, compares lookups against the shared_mutex guarded map it replaced.
+
+#include "rcu_map.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+struct _method;
+using MethodId = _method *;
+
+constexpr uint32_t kAlive = 0x11fe11fe;
+constexpr uint32_t kDead = 0xdeaddead;
+
+struct Item {
+    explicit Item(MethodId id) : id(id) {}
+    ~Item() { magic.store(kDead, std::memory_order_relaxed); }
+
+    const MethodId id;
+    std::atomic<uint32_t> magic{kAlive};
+};
+
+MethodId Id(size_t i) { return reinterpret_cast<MethodId>((i + 1) * 16); }
+
+std::atomic<bool> failed{false};
+
+void Check(bool ok, const char *what) {
+    if (ok) return;
+    if (!failed.exchange(true)) std::fprintf(stderr, "FAILED: %s\n", what);
+}
+
+int Stress() {
+    constexpr size_t kKeys = 4096;
+    constexpr int kReaders = 6;
+    constexpr int kWriters = 3;
+    constexpr int kRounds = 60000;
+    // writers go on until the readers got this far, however threads get scheduled
+    constexpr uint64_t kMinLookups = 1 << 18;
+    lspd::RcuMap<MethodId, Item> map;
+    std::atomic<int64_t> inserted{0}, erased{0};
+    std::atomic<uint64_t> lookups{0}, hits{0};
+    std::atomic<bool> stop{false};
+
+    std::vector<std::thread> threads;
+    for (int r = 0; r < kReaders; ++r) {
+        threads.emplace_back([&, r] {
+            std::mt19937 rng(r);
+            uint64_t local_hits = 0;
+            for (uint64_t n = 1; !stop.load(std::memory_order_relaxed); ++n) {
+                if (n % 1024 == 0) lookups.fetch_add(1024, std::memory_order_relaxed);
+                auto id = Id(rng() % kKeys);
+                if (auto item = map.Find(id)) {
+                    Check(item->id == id, "lookup returned the item of another key");
+                    Check(item->magic.load(std::memory_order_relaxed) == kAlive, "lookup returned a freed item");
+                    std::this_thread::yield();
+                    // a dispatch keeps its item even if it is unhooked meanwhile
+                    Check(item->magic.load(std::memory_order_relaxed) == kAlive, "item freed while referenced");
+                    ++local_hits;
+                }
+            }
+            hits += local_hits;
+        });
+    }
+    for (int w = 0; w < kWriters; ++w) {
+        threads.emplace_back([&, w] {
+            std::mt19937 rng(100 + w);
+            for (int i = 0; i < kRounds || lookups.load(std::memory_order_relaxed) < kMinLookups; ++i) {
+                auto id = Id(rng() % kKeys);
+                auto [item, created] = map.FindOrInsert(id, [&] { return std::make_shared<Item>(id); });
+                Check(item && item->id == id, "insert returned the item of another key");
+                if (created) ++inserted;
+                // unhook about half of what gets hooked, racing the other writers for it
+                if (rng() % 2 && map.EraseIf(id, item.get())) ++erased;
+                if (i % 64 == 0) std::this_thread::yield();
+            }
+        });
+    }
+    threads.emplace_back([&] {
+        while (!stop.load(std::memory_order_relaxed)) {
+            size_t live = 0;
+            map.ForEach([&](MethodId id, const std::shared_ptr<Item> &item) {
+                Check(item->id == id, "iteration paired a key with another item");
+                ++live;
+            });
+            Check(live <= kKeys, "more entries than keys");
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+    for (int i = kReaders; i < kReaders + kWriters; ++i) threads[i].join();
+    stop = true;
+    for (int i = 0; i < kReaders; ++i) threads[i].join();
+    threads.back().join();
+
+    int64_t live = 0;
+    map.ForEach([&](MethodId, const std::shared_ptr<Item> &) { ++live; });
+    Check(live == inserted - erased, "entries do not add up to inserts minus erases");
+    std::printf("rcu_map stress: %lld inserted, %lld erased, %lld left, %llu of %llu lookups hit\n",
+                static_cast<long long>(inserted.load()), static_cast<long long>(erased.load()),
+                static_cast<long long>(live), static_cast<unsigned long long>(hits.load()),
+                static_cast<unsigned long long>(lookups.load()));
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// What hooked_methods was before, one reader lock per lookup
+class LockedMap {
+public:
+    std::shared_ptr<Item> Find(MethodId id) {
+        std::shared_lock lk(lock_);
+        auto i = map_.find(id);
+        return i == map_.end() ? nullptr : i->second;
+    }
+
+    void Insert(MethodId id) {
+        std::unique_lock lk(lock_);
+        map_.emplace(id, std::make_shared<Item>(id));
+    }
+
+private:
+    std::shared_mutex lock_;
+    std::unordered_map<MethodId, std::shared_ptr<Item>> map_;
+};
+
+template<typename Map>
+double LookupsPerSecond(Map &map, int threads, size_t keys) {
+    constexpr auto kDuration = std::chrono::milliseconds(500);
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> total{0};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            uint64_t n = 0;
+            for (size_t i = t; !stop.load(std::memory_order_relaxed); ++i) {
+                if (!map.Find(Id(i % keys))) std::abort();
+                ++n;
+            }
+            total += n;
+        });
+    }
+    std::this_thread::sleep_for(kDuration);
+    stop = true;
+    for (auto &worker : workers) worker.join();
+    return total / std::chrono::duration<double>(kDuration).count();
+}
+
+int Bench() {
+    // about as many hooks as a heavily hooked app has
+    constexpr size_t kKeys = 2000;
+    lspd::RcuMap<MethodId, Item> rcu;
+    LockedMap locked;
+    for (size_t i = 0; i < kKeys; ++i) {
+        rcu.FindOrInsert(Id(i), [&] { return std::make_shared<Item>(Id(i)); });
+        locked.Insert(Id(i));
+    }
+    std::printf("threads  shared_mutex Mlookups/s  rcu_map Mlookups/s\n");
+    for (int threads : {1, 4, 8}) {
+        auto before = LookupsPerSecond(locked, threads, kKeys) / 1e6;
+        auto after = LookupsPerSecond(rcu, threads, kKeys) / 1e6;
+        std::printf("%7d  %22.1f  %18.1f\n", threads, before, after);
+    }
+    return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc > 1 && std::strcmp(argv[1], "--bench") == 0) return Bench();
+    return Stress();
+}
@@ -0,0 +1,269 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+// Registers and unregisters module libraries with their load callbacks while other threads
+// dispatch loads, the way native_api uses CopyOnWrite for its NativeRegistry, including
+// registrations from within a dispatch. Every snapshot must hold a library and its callback
+// together, and a registration must be visible to any load that starts after it returned.
+// With --bench, compares dispatch lookups against a registry behind a mutex.
+
+#include "copy_on_write.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t kAlive = 0x11fe11fe;
+
+struct Callback {
+    explicit Callback(size_t module) : module(module) {}
+
+    const size_t module;
+    std::atomic<uint32_t> magic{kAlive};
+    std::atomic<uint64_t> dispatches{0};
+    std::atomic<bool> every_load{false};
+};
+
+// NativeRegistry with std containers in place of phmap
+struct Registry {
+    std::unordered_map<std::string, std::vector<std::string>> moduleNativeLibs;
+    std::vector<Callback *> moduleLoadedCallbacks;
+    std::unordered_map<std::string, std::vector<Callback *>> callbacksByBasename;
+    uint64_t version = 0;
+};
+
+std::string Base(size_t module) { return "libmodule" + std::to_string(module) + ".so"; }
+
+std::string Path(size_t module) { return "/data/app/module" + std::to_string(module) + "/lib/" + Base(module); }
+
+std::atomic<bool> failed{false};
+
+void Check(bool ok, const char *what) {
+    if (ok) return;
+    if (!failed.exchange(true)) std::fprintf(stderr, "FAILED: %s\n", what);
+}
+
+int Stress() {
+    constexpr size_t kModules = 256;
+    constexpr int kLoaders = 4;
+    constexpr int kRegistrars = 2;
+    constexpr int kRounds = 4000;
+    // registrars go on until the loaders got this far, however threads get scheduled
+    constexpr uint64_t kMinLoads = 1 << 16;
+    lspd::CopyOnWrite<Registry> registry;
+    // odd while a module is registered. Bumped after registering and before unregistering, so a
+    // load that reads the same odd value before and after taking its snapshot must see it.
+    std::vector<std::atomic<uint64_t>> generation(kModules);
+    // callbacks outlive every snapshot, like LoadCallback records
+    std::vector<std::unique_ptr<Callback>> callbacks;
+    for (size_t m = 0; m < kModules; ++m) callbacks.push_back(std::make_unique<Callback>(m));
+    std::atomic<uint64_t> loads{0}, dispatched{0}, visible{0}, every_load{0};
+    std::atomic<bool> stop{false};
+
+    std::vector<std::thread> threads;
+    for (int l = 0; l < kLoaders; ++l) {
+        threads.emplace_back([&, l] {
+            std::mt19937 rng(l);
+            uint64_t last_version = 0;
+            for (uint64_t n = 1; !stop.load(std::memory_order_relaxed); ++n) {
+                if (n % 256 == 0) loads.fetch_add(256, std::memory_order_relaxed);
+                auto m = rng() % kModules;
+                auto before = generation[m].load();
+                const auto &current = registry.Load();
+                auto after = generation[m].load();
+                Check(current.version >= last_version, "a load saw an older snapshot than the one before");
+                last_version = current.version;
+
+                auto base = Base(m);
+                auto libs = current.moduleNativeLibs.find(base);
+                auto interested = current.callbacksByBasename.find(base);
+                Check((libs == current.moduleNativeLibs.end()) == (interested == current.callbacksByBasename.end()),
+                      "snapshot has a library without its callback or the other way round");
+                if (before == after && before % 2) {
+                    Check(libs != current.moduleNativeLibs.end(), "registration not visible to a later load");
+                    ++visible;
+                }
+                if (libs != current.moduleNativeLibs.end()) {
+                    Check(libs->second.size() == 1 && libs->second[0] == Path(m), "library registered under another name");
+                }
+                if (interested == current.callbacksByBasename.end()) continue;
+                for (auto *callback: interested->second) {
+                    Check(callback->module == m, "callback registered for another library");
+                    Check(callback->magic.load(std::memory_order_relaxed) == kAlive, "dispatch to a freed callback");
+                    callback->dispatches.fetch_add(1, std::memory_order_relaxed);
+                    ++dispatched;
+                    // native_init registering a callback for every load from within do_dlopen
+                    if (rng() % 64 == 0 && !callback->every_load.exchange(true)) {
+                        registry.Update([&](Registry &next) {
+                            next.moduleLoadedCallbacks.push_back(callback);
+                            ++next.version;
+                        });
+                        ++every_load;
+                    }
+                }
+                for (auto *callback: current.moduleLoadedCallbacks) {
+                    Check(callback->magic.load(std::memory_order_relaxed) == kAlive, "dispatch to a freed callback");
+                }
+            }
+        });
+    }
+    for (int r = 0; r < kRegistrars; ++r) {
+        threads.emplace_back([&, r] {
+            std::mt19937 rng(100 + r);
+            for (int i = 0; i < kRounds || loads.load(std::memory_order_relaxed) < kMinLoads; ++i) {
+                // each registrar owns every other module, so their generations stay exact
+                auto m = (rng() % (kModules / kRegistrars)) * kRegistrars + r;
+                if (generation[m].load() % 2 == 0) {
+                    registry.Update([&](Registry &next) {
+                        next.moduleNativeLibs[Base(m)].push_back(Path(m));
+                        next.callbacksByBasename[Base(m)].push_back(callbacks[m].get());
+                        ++next.version;
+                    });
+                    ++generation[m];
+                    Check(registry.Load().moduleNativeLibs.contains(Base(m)), "registration not visible to its thread");
+                } else {
+                    ++generation[m];
+                    registry.Update([&](Registry &next) {
+                        next.moduleNativeLibs.erase(Base(m));
+                        next.callbacksByBasename.erase(Base(m));
+                        ++next.version;
+                    });
+                }
+                if (i % 16 == 0) std::this_thread::yield();
+            }
+        });
+    }
+    for (int i = kLoaders; i < kLoaders + kRegistrars; ++i) threads[i].join();
+    stop = true;
+    for (int i = 0; i < kLoaders; ++i) threads[i].join();
+
+    const auto &last = registry.Load();
+    size_t registered = 0;
+    for (size_t m = 0; m < kModules; ++m) {
+        bool expected = generation[m].load() % 2;
+        registered += expected;
+        Check(last.moduleNativeLibs.contains(Base(m)) == expected, "final snapshot lost a registration");
+    }
+    Check(last.moduleLoadedCallbacks.size() == every_load, "final snapshot lost an every load callback");
+    uint64_t counted = 0;
+    for (const auto &callback: callbacks) counted += callback->dispatches.load();
+    Check(counted == dispatched, "dispatch counts do not add up");
+    std::printf("registry stress: %llu snapshots, %zu modules left, %llu loads, %llu dispatches, "
+                "%llu loads that had to see a registration, %llu registered from a dispatch\n",
+                static_cast<unsigned long long>(last.version), registered,
+                static_cast<unsigned long long>(loads.load()),
+                static_cast<unsigned long long>(dispatched.load()),
+                static_cast<unsigned long long>(visible.load()),
+                static_cast<unsigned long long>(every_load.load()));
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// The alternative to snapshots, every load takes the lock for its lookup
+class LockedRegistry {
+public:
+    template<typename Modify>
+    void Update(Modify &&modify) {
+        std::lock_guard lk(lock_);
+        modify(registry_);
+    }
+
+    template<typename Lookup>
+    void Dispatch(Lookup &&dispatch) {
+        std::lock_guard lk(lock_);
+        dispatch(registry_);
+    }
+
+private:
+    std::mutex lock_;
+    Registry registry_;
+};
+
+template<typename Lookup>
+double LoadsPerSecond(Lookup &&lookup, int threads, size_t modules) {
+    constexpr auto kDuration = std::chrono::milliseconds(500);
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> total{0};
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            // most loads are of libraries no module registered
+            std::vector<std::string> names;
+            for (size_t m = 0; m < 64; ++m) names.push_back(Base(m % 4 ? modules + m : m + t));
+            uint64_t n = 0;
+            for (size_t i = 0; !stop.load(std::memory_order_relaxed); ++i) {
+                lookup(names[i % names.size()]);
+                ++n;
+            }
+            total += n;
+        });
+    }
+    std::this_thread::sleep_for(kDuration);
+    stop = true;
+    for (auto &worker : workers) worker.join();
+    return total / std::chrono::duration<double>(kDuration).count();
+}
+
+int Bench() {
+    constexpr size_t kModules = 64;
+    lspd::CopyOnWrite<Registry> snapshots;
+    LockedRegistry locked;
+    std::vector<std::unique_ptr<Callback>> callbacks;
+    auto add = [&](Registry &next, size_t m) {
+        next.moduleNativeLibs[Base(m)].push_back(Path(m));
+        next.callbacksByBasename[Base(m)].push_back(callbacks.emplace_back(std::make_unique<Callback>(m)).get());
+    };
+    for (size_t m = 0; m < kModules; ++m) {
+        snapshots.Update([&](Registry &next) { add(next, m); });
+        locked.Update([&](Registry &next) { add(next, m); });
+    }
+    auto dispatch = [](const Registry &current, const std::string &name) {
+        if (auto i = current.callbacksByBasename.find(name); i != current.callbacksByBasename.end()) {
+            for (auto *callback: i->second) callback->dispatches.fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+    std::printf("threads  mutex Mloads/s  snapshot Mloads/s\n");
+    for (int threads : {1, 4, 8}) {
+        auto before = LoadsPerSecond([&](const std::string &name) {
+            locked.Dispatch([&](const Registry &current) { dispatch(current, name); });
+        }, threads, kModules) / 1e6;
+        auto after = LoadsPerSecond([&](const std::string &name) {
+            dispatch(snapshots.Load(), name);
+        }, threads, kModules) / 1e6;
+        std::printf("%7d  %14.1f  %17.1f\n", threads, before, after);
+    }
+    return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc > 1 && std::strcmp(argv[1], "--bench") == 0) return Bench();
+    return Stress();
+}
@@ -0,0 +1,146 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+// The startup timeline of the loader. Checks that the phases add up to the time they span minus
+// what was skipped with Resume, and that they are in the order the daemon labels them in.
+// With --bench, measures what timing a process start costs.
+
+#include "startup_timeline.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using lspd::StartupTimeline;
+using namespace std::chrono_literals;
+
+int64_t Nanos(std::chrono::nanoseconds d) { return d.count(); }
+
+bool CheckDurations() {
+    StartupTimeline timeline;
+    auto start = std::chrono::steady_clock::now();
+    timeline.Start();
+    std::this_thread::sleep_for(2ms);
+    timeline.Mark(StartupTimeline::kCompanion);
+    std::this_thread::sleep_for(1ms);
+    timeline.Mark(StartupTimeline::kSpecializePre);
+    // zygote specializing the process, not ours to count
+    std::this_thread::sleep_for(20ms);
+    timeline.Resume();
+    for (int phase = StartupTimeline::kRequestBinder; phase < StartupTimeline::kPhaseCount; ++phase) {
+        std::this_thread::sleep_for(1ms);
+        timeline.Mark(static_cast<StartupTimeline::Phase>(phase));
+    }
+    auto elapsed = Nanos(std::chrono::steady_clock::now() - start);
+    const auto &durations = timeline.durations();
+    auto total = std::accumulate(durations.begin(), durations.end(), int64_t{0});
+    for (auto duration : durations) {
+        if (duration < Nanos(1ms)) {
+            std::fprintf(stderr, "FAILED: a phase took less than it slept\n");
+            return false;
+        }
+    }
+    if (total < Nanos(10ms) || total > elapsed - Nanos(20ms)) {
+        std::fprintf(stderr, "FAILED: phases add up to %lld ns of %lld ns with 20 ms skipped\n",
+                     static_cast<long long>(total), static_cast<long long>(elapsed));
+        return false;
+    }
+    timeline.Start();
+    timeline.Mark(StartupTimeline::kCompanion);
+    if (durations[StartupTimeline::kForkCommon] != 0) {
+        std::fprintf(stderr, "FAILED: Start kept the durations of the previous timeline\n");
+        return false;
+    }
+    return true;
+}
+
+// StartupTimelines.PHASES, in enum order
+bool CheckPhaseNames() {
+    std::ifstream in(DAEMON_SOURCES "/org/lsposed/lspd/service/StartupTimelines.java");
+    std::stringstream source;
+    source << in.rdbuf();
+    auto text = source.str();
+    auto begin = text.find("PHASES = {");
+    auto end = text.find('}', begin);
+    if (begin == std::string::npos || end == std::string::npos) {
+        std::fprintf(stderr, "FAILED: no PHASES in StartupTimelines.java\n");
+        return false;
+    }
+    std::vector<std::string> names;
+    for (auto quote = text.find('"', begin); quote < end; quote = text.find('"', quote + 1)) {
+        auto closing = text.find('"', quote + 1);
+        names.push_back(text.substr(quote + 1, closing - quote - 1));
+        quote = closing;
+    }
+    const std::vector<std::string> expected = {
+            "companion", "specializePre", "requestBinder", "bootstrap", "loadDex",
+            "initArtHooker", "initHooks", "setupEntryClass", "forkCommon",
+    };
+    static_assert(StartupTimeline::kCompanion == 0 && StartupTimeline::kInitArtHooker == 5 &&
+                  StartupTimeline::kForkCommon == 8 && StartupTimeline::kPhaseCount == 9);
+    if (names != expected) {
+        std::fprintf(stderr, "FAILED: the daemon labels %zu phases differently than the loader\n", names.size());
+        return false;
+    }
+    return true;
+}
+
+int Check() {
+    if (!CheckDurations() || !CheckPhaseNames()) return EXIT_FAILURE;
+    std::printf("startup timeline: %d phases, in sync with the daemon\n", StartupTimeline::kPhaseCount);
+    return EXIT_SUCCESS;
+}
+
+int Bench() {
+    constexpr int kStarts = 1000000;
+    StartupTimeline timeline;
+    int64_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kStarts; ++i) {
+        // what the loader does per process
+        timeline.Start();
+        timeline.Mark(StartupTimeline::kCompanion);
+        timeline.Mark(StartupTimeline::kSpecializePre);
+        timeline.Resume();
+        for (int phase = StartupTimeline::kRequestBinder; phase < StartupTimeline::kPhaseCount; ++phase) {
+            timeline.Mark(static_cast<StartupTimeline::Phase>(phase));
+        }
+        sink += timeline.durations()[StartupTimeline::kForkCommon];
+    }
+    auto elapsed = Nanos(std::chrono::steady_clock::now() - start);
+    std::printf("%.1f ns of timing per process start (%d clock reads)%s\n",
+                static_cast<double>(elapsed) / kStarts, StartupTimeline::kPhaseCount + 2, sink < 0 ? "!" : "");
+    return EXIT_SUCCESS;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    if (argc > 1 && std::strcmp(argv[1], "--bench") == 0) return Bench();
+    return Check();
+}
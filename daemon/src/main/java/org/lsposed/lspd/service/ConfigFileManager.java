@@ -279,6 +279,8 @@ public class ConfigFileManager {
             }
             zipAddFile(os, dbPath.toPath(), configDirPath);
             ConfigManager.getInstance().exportScopes(os);
+            LSPApplicationService.dumpHookProfiles(os);
+            StartupTimelines.dump(os);
         } catch (Throwable e) {
             Log.w(TAG, "get log", e);
             throw new IllegalStateException(e);
@@ -100,6 +100,7 @@ public class ConfigManager {
     private boolean verboseLog = true;
     private boolean logWatchdog = true;
     private boolean dexObfuscate = true;
+    private boolean frameworkCompilation = false;
     private boolean injectionHardening = true;
     private boolean enableStatusNotification = true;
     private Path miscPath = null;
@@ -279,6 +280,9 @@ public class ConfigManager {
         bool = config.get("enable_dex_obfuscate");
         dexObfuscate = bool == null || (boolean) bool;
 
+        bool = config.get("enable_framework_compilation");
+        frameworkCompilation = bool != null && (boolean) bool;
+
         bool = config.get("enable_auto_add_shortcut");
         if (bool != null) {
             // TODO: remove
@@ -1041,6 +1045,15 @@ public class ConfigManager {
         updateModulePrefs("lspd", 0, "config", "enable_dex_obfuscate", on);
     }
 
+    public void setFrameworkCompilation(boolean on) {
+        updateModulePrefs("lspd", 0, "config", "enable_framework_compilation", on);
+        frameworkCompilation = on;
+    }
+
+    public boolean isFrameworkCompilationEnabled() {
+        return frameworkCompilation;
+    }
+
     public boolean scopeRequestBlocked(String packageName) {
         return scopeRequestBlocked.contains(packageName);
     }
@@ -1217,7 +1230,9 @@ public class ConfigManager {
     }
 
     synchronized SharedMemory getPreloadDex() {
-        return ConfigFileManager.getPreloadDex(dexObfuscate);
+        var dex = ConfigFileManager.getPreloadDex(dexObfuscate);
+        FrameworkOatManager.schedule(miscPath, dex, frameworkCompilation && !dexObfuscate);
+        return dex;
     }
 
     public boolean getAutoInclude(String packageName) {
@@ -0,0 +1,75 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+package org.lsposed.lspd.service;
+
+import static org.lsposed.lspd.service.ServiceManager.TAG;
+
+import android.content.res.Resources;
+import android.content.res.TypedArray;
+import android.os.ParcelFileDescriptor;
+import android.util.Log;
+import android.util.Pair;
+
+import java.io.IOException;
+import java.util.Map;
+import java.util.concurrent.ConcurrentHashMap;
+
+// Dummy superclasses for XResources, generated once per pair of superclasses for all processes
+public class DummyDexManager {
+    // a device has one pair in practice, processes beyond the limit build their own
+    private static final int MAX_DEXES = 4;
+    private static final Map<Pair<String, String>, ParcelFileDescriptor> dexes = new ConcurrentHashMap<>();
+
+    // returns a sealed memfd holding the dex
+    static native int buildDummyDex(String resourceSuperClass, String typedArraySuperClass);
+
+    // the superclasses are the framework's own, which the daemon sees the same as apps do
+    private static boolean isBootSubclass(String className, Class<?> superClass) {
+        try {
+            return superClass.isAssignableFrom(Class.forName(className, false, null));
+        } catch (ClassNotFoundException | LinkageError e) {
+            return false;
+        }
+    }
+
+    static ParcelFileDescriptor getDummyDex(String resourceSuperClass, String typedArraySuperClass) {
+        if (resourceSuperClass == null || typedArraySuperClass == null) return null;
+        var key = new Pair<>(resourceSuperClass, typedArraySuperClass);
+        if (!dexes.containsKey(key)) {
+            if (!isBootSubclass(resourceSuperClass, Resources.class) ||
+                    !isBootSubclass(typedArraySuperClass, TypedArray.class)) {
+                Log.w(TAG, "refuse dummy dex for " + resourceSuperClass + ", " + typedArraySuperClass);
+                return null;
+            }
+            if (dexes.size() >= MAX_DEXES) return null;
+        }
+        var dex = dexes.computeIfAbsent(key, k -> {
+            var fd = buildDummyDex(k.first, k.second);
+            return fd < 0 ? null : ParcelFileDescriptor.adoptFd(fd);
+        });
+        if (dex == null) return null;
+        try {
+            return dex.dup();
+        } catch (IOException e) {
+            Log.e(TAG, "dup dummy dex", e);
+            return null;
+        }
+    }
+}
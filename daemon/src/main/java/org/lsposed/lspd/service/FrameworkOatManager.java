@@ -0,0 +1,240 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+package org.lsposed.lspd.service;
+
+import static org.lsposed.lspd.service.ServiceManager.TAG;
+
+import android.os.Build;
+import android.os.SELinux;
+import android.os.SharedMemory;
+import android.system.ErrnoException;
+import android.system.Os;
+import android.util.Log;
+
+import org.lsposed.daemon.BuildConfig;
+
+import java.io.File;
+import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.channels.FileChannel;
+import java.nio.charset.StandardCharsets;
+import java.nio.file.Files;
+import java.nio.file.Path;
+import java.nio.file.StandardOpenOption;
+import java.security.MessageDigest;
+import java.security.NoSuchAlgorithmException;
+import java.util.LinkedHashSet;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.TimeUnit;
+
+/**
+ * Compiles the framework dex with the device's dex2oat once, so that injected processes can load
+ * it from disk together with its odex and vdex instead of verifying and interpreting it in every
+ * process. The result is keyed by framework version, dex content and boot image, and lives in
+ * the misc directory which apps can traverse but not list.
+ * <p>
+ * An on-disk copy of the framework gives away what dex obfuscation hides, and an obfuscated dex
+ * differs on every daemon start anyway, so this is opt-in and only done without obfuscation.
+ */
+public class FrameworkOatManager {
+    private static final String DEX_NAME = "lspd.dex";
+    private static final long DEX2OAT_TIMEOUT_MINUTES = 5;
+    // The loader puts the dex under the system class loader of zygote children, whose class path
+    // is "." and so holds no dex, with the boot class path above it. ART rejects the odex if the
+    // actual loaders differ and runs the dex itself.
+    private static final String CLASS_LOADER_CONTEXT = "PCL[];PCL[]";
+    // a device whose dex2oat keeps failing is not asked again every time a process starts
+    private static final int MAX_ATTEMPTS = 3;
+
+    private static final ExecutorService worker = Executors.newSingleThreadExecutor(r -> new Thread(r, "lspd-framework-oat"));
+
+    private static volatile String compiledDexPath = null;
+    // the state the worker was last asked for, cleared when a compile fails so that it is retried
+    private static boolean scheduled = false;
+    private static boolean enabled = false;
+    private static int attempts = 0;
+
+    // null until the dex has been compiled for every instruction set of the device
+    static String getCompiledDexPath() {
+        return compiledDexPath;
+    }
+
+    static synchronized void schedule(Path miscPath, SharedMemory dex, boolean enable) {
+        if (miscPath == null || dex == null || (scheduled && enabled == enable)) return;
+        var root = miscPath.resolve("framework");
+        scheduled = true;
+        enabled = enable;
+        if (!enable) {
+            compiledDexPath = null;
+            worker.execute(() -> {
+                // again, a compile queued before may have finished in between
+                compiledDexPath = null;
+                try {
+                    ConfigFileManager.deleteFolderIfExists(root);
+                } catch (IOException e) {
+                    Log.e(TAG, "delete compiled framework dex", e);
+                }
+            });
+            return;
+        }
+        if (attempts >= MAX_ATTEMPTS) return;
+        ++attempts;
+        worker.execute(() -> {
+            boolean compiled = false;
+            try {
+                compiled = compile(root, dex);
+            } catch (Throwable t) {
+                Log.e(TAG, "compile framework dex", t);
+            }
+            if (!compiled) {
+                synchronized (FrameworkOatManager.class) {
+                    if (enabled) scheduled = false;
+                }
+            }
+        });
+    }
+
+    private static String isaOf(String abi) {
+        return switch (abi) {
+            case "arm64-v8a" -> "arm64";
+            case "armeabi-v7a" -> "arm";
+            case "x86_64", "x86", "riscv64" -> abi;
+            default -> null;
+        };
+    }
+
+    private static boolean is64Bit(String isa) {
+        return isa.equals("arm64") || isa.equals("x86_64") || isa.equals("riscv64");
+    }
+
+    private static String dex2oatFor(String isa) {
+        if (Build.VERSION.SDK_INT == Build.VERSION_CODES.Q) {
+            return "/apex/com.android.runtime/bin/dex2oat";
+        }
+        return is64Bit(isa) ? "/apex/com.android.art/bin/dex2oat64" : "/apex/com.android.art/bin/dex2oat32";
+    }
+
+    private static void digestFile(MessageDigest digest, String path) {
+        try {
+            var stat = Os.stat(path);
+            digest.update((path + ':' + stat.st_size + ':' + stat.st_mtime).getBytes(StandardCharsets.UTF_8));
+        } catch (ErrnoException ignored) {
+        }
+    }
+
+    // what the compiled code depends on: the framework, its dex, its loaders and the boot image
+    // per isa
+    private static String key(ByteBuffer dex, Iterable<String> isas) throws NoSuchAlgorithmException {
+        var digest = MessageDigest.getInstance("SHA-256");
+        digest.update(dex.duplicate());
+        digest.update(Build.FINGERPRINT.getBytes(StandardCharsets.UTF_8));
+        digest.update(CLASS_LOADER_CONTEXT.getBytes(StandardCharsets.UTF_8));
+        for (var isa : isas) {
+            digestFile(digest, "/apex/com.android.art/javalib/" + isa + "/boot.art");
+            digestFile(digest, "/system/framework/" + isa + "/boot.art");
+            digestFile(digest, "/system/framework/" + isa + "/boot-framework.art");
+        }
+        var sb = new StringBuilder().append(BuildConfig.VERSION_CODE).append('-');
+        for (var b : digest.digest()) {
+            sb.append(String.format("%02x", b));
+        }
+        return sb.toString();
+    }
+
+    private static void makeReadable(Path path, int mode) throws ErrnoException {
+        SELinux.setFileContext(path.toString(), "u:object_r:xposed_data:s0");
+        Os.chown(path.toString(), 0, 0);
+        Os.chmod(path.toString(), mode);
+    }
+
+    private static boolean runDex2oat(String isa, Path dexPath, Path odexPath) throws IOException, InterruptedException {
+        var dex2oat = dex2oatFor(isa);
+        if (!new File(dex2oat).exists()) return false;
+        var process = new ProcessBuilder(dex2oat,
+                "--dex-file=" + dexPath,
+                "--dex-location=" + dexPath,
+                "--oat-file=" + odexPath,
+                "--instruction-set=" + isa,
+                "--compiler-filter=speed",
+                "--class-loader-context=" + CLASS_LOADER_CONTEXT)
+                .redirectErrorStream(true)
+                .redirectOutput(new File("/dev/null"))
+                .start();
+        if (!process.waitFor(DEX2OAT_TIMEOUT_MINUTES, TimeUnit.MINUTES)) {
+            process.destroyForcibly();
+            Log.w(TAG, "dex2oat timed out for " + isa);
+            return false;
+        }
+        return process.exitValue() == 0 && Files.exists(odexPath);
+    }
+
+    private static boolean compile(Path root, SharedMemory dex) throws Exception {
+        var isas = new LinkedHashSet<String>();
+        for (var abi : Build.SUPPORTED_ABIS) {
+            var isa = isaOf(abi);
+            if (isa != null) isas.add(isa);
+        }
+        var buffer = dex.mapReadOnly();
+        try {
+            var dir = root.resolve(key(buffer, isas));
+            var dexPath = dir.resolve(DEX_NAME);
+            boolean ready = Files.exists(dexPath);
+            for (var isa : isas) {
+                ready = ready && Files.exists(dir.resolve("oat").resolve(isa).resolve("lspd.odex"));
+            }
+            if (ready) {
+                compiledDexPath = dexPath.toString();
+                Log.i(TAG, "framework dex already compiled at " + dir);
+                return true;
+            }
+            // results of an older framework, dex or boot image are of no use any more
+            ConfigFileManager.deleteFolderIfExists(root);
+            Files.createDirectories(dir.resolve("oat"));
+            makeReadable(root, 0711);
+            makeReadable(dir, 0711);
+            makeReadable(dir.resolve("oat"), 0711);
+            try (var channel = FileChannel.open(dexPath, StandardOpenOption.CREATE_NEW, StandardOpenOption.WRITE)) {
+                channel.write(buffer.duplicate());
+            }
+            makeReadable(dexPath, 0644);
+            for (var isa : isas) {
+                var isaDir = dir.resolve("oat").resolve(isa);
+                Files.createDirectories(isaDir);
+                makeReadable(isaDir, 0711);
+                var odexPath = isaDir.resolve("lspd.odex");
+                var start = System.nanoTime();
+                if (!runDex2oat(isa, dexPath, odexPath)) {
+                    Log.w(TAG, "failed to compile framework dex for " + isa);
+                    return false;
+                }
+                makeReadable(odexPath, 0644);
+                var vdexPath = isaDir.resolve("lspd.vdex");
+                if (Files.exists(vdexPath)) makeReadable(vdexPath, 0644);
+                Log.i(TAG, "compiled framework dex for " + isa + " in " +
+                        TimeUnit.NANOSECONDS.toMillis(System.nanoTime() - start) + "ms");
+            }
+            compiledDexPath = dexPath.toString();
+            return true;
+        } finally {
+            SharedMemory.unmap(buffer);
+        }
+    }
+}
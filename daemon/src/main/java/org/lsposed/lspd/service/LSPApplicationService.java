@@ -26,6 +26,9 @@ import android.os.Parcel;
 import android.os.ParcelFileDescriptor;
 import android.os.Process;
 import android.os.RemoteException;
+import android.os.SharedMemory;
+import android.system.ErrnoException;
+import android.system.OsConstants;
 import android.util.Log;
 import android.util.Pair;
 
@@ -33,23 +36,40 @@ import androidx.annotation.NonNull;
 
 import org.lsposed.lspd.models.Module;
 
+import java.io.IOException;
+import java.nio.ByteOrder;
+import java.nio.charset.StandardCharsets;
+import java.util.ArrayList;
 import java.util.Collections;
 import java.util.List;
 import java.util.Map;
 import java.util.concurrent.ConcurrentHashMap;
 import java.util.stream.Collectors;
+import java.util.zip.ZipEntry;
+import java.util.zip.ZipOutputStream;
 
 public class LSPApplicationService extends ILSPApplicationService.Stub {
     final static int DEX_TRANSACTION_CODE = 1310096052;
     final static int OBFUSCATION_MAP_TRANSACTION_CODE = 724533732;
+    final static int BOOTSTRAP_TRANSACTION_CODE = 1112493140;
+    final static int STARTUP_TIMELINE_TRANSACTION_CODE = 1414090316;
+    final static int ART_SYMBOLS_TRANSACTION_CODE = 1095914323;
+    private final static int MAX_ART_SYMBOLS_SIZE = 1 << 20;
+    private final static int MAX_ART_SYMBOL_TABLES = 4;
     // key: <uid, pid>
     private final static Map<Pair<Integer, Integer>, ProcessInfo> processes = new ConcurrentHashMap<>();
+    private static volatile boolean hookProfiling = false;
+    // packed obfuscation map, for the map with obfuscation enabled and without
+    private final static SharedMemory[] packedObfuscationMaps = new SharedMemory[2];
+    // key: libart build id, tables of art symbol offsets recorded by the first process of a boot
+    private final static Map<String, SharedMemory> artSymbolTables = new ConcurrentHashMap<>();
 
     static class ProcessInfo implements DeathRecipient {
         final int uid;
         final int pid;
         final String processName;
         final IBinder heartBeat;
+        volatile IHookProfiler hookProfiler;
 
         ProcessInfo(int uid, int pid, String processName, IBinder heartBeat) throws RemoteException {
             this.uid = uid;
@@ -92,6 +112,58 @@ public class LSPApplicationService extends ILSPApplicationService.Stub {
                 reply.writeLong(shm.getSize());
                 return true;
             }
+            case BOOTSTRAP_TRANSACTION_CODE: {
+                // dex and obfuscation map in one go, the map packed for the loader to parse natively
+                var artBuildId = data.readString();
+                var shm = ConfigManager.getInstance().getPreloadDex();
+                if (shm == null) return false;
+                var map = getPackedObfuscationMap(ConfigManager.getInstance().dexObfuscate());
+                if (map == null) return false;
+                shm.writeToParcel(reply, 0);
+                reply.writeLong(shm.getSize());
+                map.writeToParcel(reply, 0);
+                reply.writeLong(map.getSize());
+                // null while the compiled framework dex is not ready
+                reply.writeString(FrameworkOatManager.getCompiledDexPath());
+                var artSymbols = artBuildId == null ? null : artSymbolTables.get(artBuildId);
+                if (artSymbols != null) {
+                    reply.writeInt(1);
+                    artSymbols.writeToParcel(reply, 0);
+                    reply.writeLong(artSymbols.getSize());
+                } else {
+                    reply.writeInt(0);
+                }
+                return true;
+            }
+            case ART_SYMBOLS_TRANSACTION_CODE: {
+                // every later process trusts the table, so only the registered system server may
+                // set it; not oneway, so that the calling pid is there to check
+                try {
+                    var processInfo = ensureRegistered();
+                    if (processInfo.uid != Process.SYSTEM_UID || !"system".equals(processInfo.processName)) {
+                        Log.w(TAG, "drop art symbols from " + processInfo);
+                        return true;
+                    }
+                } catch (RemoteException e) {
+                    return true;
+                }
+                putArtSymbols(data.readString(), data.createByteArray());
+                return true;
+            }
+            case STARTUP_TIMELINE_TRANSACTION_CODE: {
+                // oneway, sent once the process has finished forkCommon. Oneway calls have no
+                // calling pid, so the process sends its own and only the uid is trusted; the name
+                // comes from what the process registered as
+                int pid = data.readInt();
+                var callingPid = getCallingPid();
+                var processInfo = processes.get(new Pair<>(getCallingUid(), pid));
+                if (processInfo == null || (callingPid != 0 && callingPid != pid)) {
+                    Log.w(TAG, "drop startup timeline of unregistered " + getCallingUid() + "/" + pid);
+                    return true;
+                }
+                StartupTimelines.record(processInfo.processName, data);
+                return true;
+            }
             case OBFUSCATION_MAP_TRANSACTION_CODE: {
                 var obfuscation = ConfigManager.getInstance().dexObfuscate();
                 var signatures = ObfuscationManager.getSignatures();
@@ -107,6 +179,59 @@ public class LSPApplicationService extends ILSPApplicationService.Stub {
         return super.onTransact(code, data, reply, flags);
     }
 
+    // u32 count, then count pairs of u32 length + UTF-8 bytes for key and value, little endian
+    private static synchronized SharedMemory getPackedObfuscationMap(boolean obfuscation) {
+        var index = obfuscation ? 1 : 0;
+        if (packedObfuscationMaps[index] != null) return packedObfuscationMaps[index];
+        var signatures = ObfuscationManager.getSignatures();
+        var entries = new ArrayList<byte[]>(signatures.size() * 2);
+        int size = Integer.BYTES;
+        for (Map.Entry<String, String> entry : signatures.entrySet()) {
+            var key = entry.getKey().getBytes(StandardCharsets.UTF_8);
+            // value = key if obfuscation disabled
+            var value = obfuscation ? entry.getValue().getBytes(StandardCharsets.UTF_8) : key;
+            entries.add(key);
+            entries.add(value);
+            size += 2 * Integer.BYTES + key.length + value.length;
+        }
+        try {
+            var memory = SharedMemory.create("obfuscation_map", size);
+            var buffer = memory.mapReadWrite().order(ByteOrder.LITTLE_ENDIAN);
+            buffer.putInt(signatures.size());
+            for (var bytes : entries) {
+                buffer.putInt(bytes.length);
+                buffer.put(bytes);
+            }
+            SharedMemory.unmap(buffer);
+            memory.setProtect(OsConstants.PROT_READ);
+            packedObfuscationMaps[index] = memory;
+            return memory;
+        } catch (ErrnoException e) {
+            Log.e(TAG, "pack obfuscation map", e);
+            return null;
+        }
+    }
+
+    // see ArtSymbolCache in the loader for the layout, which only the loader parses
+    private static void putArtSymbols(String buildId, byte[] table) {
+        if (buildId == null || buildId.isEmpty() || table == null || table.length > MAX_ART_SYMBOLS_SIZE) return;
+        if (artSymbolTables.containsKey(buildId) || artSymbolTables.size() >= MAX_ART_SYMBOL_TABLES) return;
+        try {
+            var memory = SharedMemory.create("art_symbols", table.length);
+            var buffer = memory.mapReadWrite();
+            buffer.put(table);
+            SharedMemory.unmap(buffer);
+            memory.setProtect(OsConstants.PROT_READ);
+            if (artSymbolTables.putIfAbsent(buildId, memory) != null) {
+                memory.close();
+            } else {
+                Log.d(TAG, "cached " + table.length + " bytes of art symbols for libart " + buildId);
+            }
+        } catch (ErrnoException e) {
+            Log.e(TAG, "cache art symbols", e);
+        }
+    }
+
     public boolean registerHeartBeat(int uid, int pid, String processName, IBinder heartBeat) {
         try {
             new ProcessInfo(uid, pid, processName, heartBeat);
@@ -157,6 +282,55 @@ public class LSPApplicationService extends ILSPApplicationService.Stub {
         return ConfigManager.getInstance().getManagerApk();
     }
 
+    @Override
+    public boolean registerHookProfiler(IHookProfiler profiler) throws RemoteException {
+        ensureRegistered().hookProfiler = profiler;
+        return hookProfiling;
+    }
+
+    @Override
+    public ParcelFileDescriptor requestDummyDex(String resourceSuperClass, String typedArraySuperClass) throws RemoteException {
+        ensureRegistered();
+        return DummyDexManager.getDummyDex(resourceSuperClass, typedArraySuperClass);
+    }
+
+    static boolean isHookProfiling() {
+        return hookProfiling;
+    }
+
+    static void setHookProfiling(boolean enabled) {
+        hookProfiling = enabled;
+        for (var processInfo : processes.values()) {
+            var profiler = processInfo.hookProfiler;
+            if (profiler == null) continue;
+            try {
+                profiler.setEnabled(enabled);
+            } catch (RemoteException e) {
+                Log.w(TAG, "set hook profiling of " + processInfo, e);
+            }
+        }
+    }
+
+    // pulls what the processes recorded since the last time, records are gone afterwards
+    static void dumpHookProfiles(ZipOutputStream os) throws IOException {
+        os.putNextEntry(new ZipEntry("hook_profiles.txt"));
+        for (var processInfo : processes.values()) {
+            var profiler = processInfo.hookProfiler;
+            if (profiler == null) continue;
+            try {
+                var records = profiler.drain();
+                if (records == null || records.length == 0) continue;
+                os.write((processInfo.processName + "/" + processInfo.pid + "\n").getBytes(StandardCharsets.UTF_8));
+                for (var record : records) {
+                    os.write(("\t" + record + "\n").getBytes(StandardCharsets.UTF_8));
+                }
+            } catch (RemoteException e) {
+                Log.w(TAG, "drain hook profile of " + processInfo, e);
+            }
+        }
+        os.closeEntry();
+    }
+
     public boolean hasRegister(int uid, int pid) {
         return processes.containsKey(new Pair<>(uid, pid));
     }
@@ -566,4 +566,24 @@ public class LSPManagerService extends ILSPManagerService.Stub {
     public boolean getAutoInclude(String packageName) {
         return ConfigManager.getInstance().getAutoInclude(packageName);
     }
+
+    @Override
+    public boolean isHookProfiling() {
+        return LSPApplicationService.isHookProfiling();
+    }
+
+    @Override
+    public void setHookProfiling(boolean enabled) {
+        LSPApplicationService.setHookProfiling(enabled);
+    }
+
+    @Override
+    public boolean isFrameworkCompilationEnabled() {
+        return ConfigManager.getInstance().isFrameworkCompilationEnabled();
+    }
+
+    @Override
+    public void setFrameworkCompilation(boolean enabled) {
+        ConfigManager.getInstance().setFrameworkCompilation(enabled);
+    }
 }
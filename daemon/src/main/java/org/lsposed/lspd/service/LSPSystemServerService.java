@@ -110,7 +110,10 @@ public class LSPSystemServerService extends ILSPSystemServerService.Stub impleme
                     return false;
                 }
             }
-            case LSPApplicationService.OBFUSCATION_MAP_TRANSACTION_CODE, LSPApplicationService.DEX_TRANSACTION_CODE -> {
+            case LSPApplicationService.OBFUSCATION_MAP_TRANSACTION_CODE, LSPApplicationService.DEX_TRANSACTION_CODE,
+                    LSPApplicationService.BOOTSTRAP_TRANSACTION_CODE,
+                    LSPApplicationService.STARTUP_TIMELINE_TRANSACTION_CODE,
+                    LSPApplicationService.ART_SYMBOLS_TRANSACTION_CODE -> {
                 // Proxy LSP dex transaction to Application Binder
                 return ServiceManager.getApplicationService().onTransact(code, data, reply, flags);
             }
@@ -0,0 +1,118 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+package org.lsposed.lspd.service;
+
+import static org.lsposed.lspd.service.ServiceManager.TAG;
+
+import android.os.Parcel;
+import android.util.Log;
+
+import java.io.IOException;
+import java.nio.charset.StandardCharsets;
+import java.util.Arrays;
+import java.util.Locale;
+import java.util.Map;
+import java.util.TreeMap;
+import java.util.zip.ZipEntry;
+import java.util.zip.ZipOutputStream;
+
+/**
+ * Startup timelines reported by injected processes, aggregated per package. Keeps the most recent
+ * samples of every package to tell the median and tail overhead of injecting into it.
+ */
+public class StartupTimelines {
+    // keep in sync with StartupTimeline::Phase in the loader
+    private static final String[] PHASES = {
+            "companion", "specializePre", "requestBinder", "bootstrap", "loadDex",
+            "initArtHooker", "initHooks", "setupEntryClass", "forkCommon",
+    };
+    private static final int MAX_SAMPLES = 256;
+    private static final int MAX_PACKAGES = 1024;
+
+    private static class Samples {
+        // the last column is the total of a sample
+        final long[][] durations = new long[MAX_SAMPLES][];
+        int next = 0;
+        int count = 0;
+
+        void add(long[] sample) {
+            durations[next] = sample;
+            next = (next + 1) % MAX_SAMPLES;
+            if (count < MAX_SAMPLES) ++count;
+        }
+
+        long percentile(int column, int percent) {
+            var values = new long[count];
+            for (int i = 0; i < count; ++i) {
+                values[i] = durations[i][column];
+            }
+            Arrays.sort(values);
+            return values[Math.min(count - 1, count * percent / 100)];
+        }
+    }
+
+    private static final Map<String, Samples> packages = new TreeMap<>();
+
+    // phase count, then the duration of every phase in nanoseconds
+    static void record(String processName, Parcel data) {
+        int phases = data.readInt();
+        if (phases != PHASES.length) {
+            Log.w(TAG, "drop startup timeline of " + processName + " with " + phases + " phases");
+            return;
+        }
+        var sample = new long[PHASES.length + 1];
+        for (int i = 0; i < PHASES.length; ++i) {
+            sample[i] = data.readLong();
+            sample[PHASES.length] += sample[i];
+        }
+        var packageName = processName.split(":", 2)[0];
+        synchronized (packages) {
+            var samples = packages.get(packageName);
+            if (samples == null) {
+                if (packages.size() >= MAX_PACKAGES) return;
+                samples = new Samples();
+                packages.put(packageName, samples);
+            }
+            samples.add(sample);
+        }
+    }
+
+    private static String millis(long nanos) {
+        return String.format(Locale.ROOT, "%.2f", nanos / 1e6);
+    }
+
+    static void dump(ZipOutputStream os) throws IOException {
+        var sb = new StringBuilder("package\tsamples\tphase\tp50(ms)\tp99(ms)\n");
+        synchronized (packages) {
+            for (var entry : packages.entrySet()) {
+                var samples = entry.getValue();
+                for (int i = 0; i <= PHASES.length; ++i) {
+                    sb.append(entry.getKey()).append('\t').append(samples.count).append('\t')
+                            .append(i < PHASES.length ? PHASES[i] : "total").append('\t')
+                            .append(millis(samples.percentile(i, 50))).append('\t')
+                            .append(millis(samples.percentile(i, 99))).append('\n');
+                }
+            }
+        }
+        os.putNextEntry(new ZipEntry("startup_timelines.tsv"));
+        os.write(sb.toString().getBytes(StandardCharsets.UTF_8));
+        os.closeEntry();
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+#include <jni.h>
+#include <fcntl.h>
+#include <linux/memfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <string>
+
+#include "dex_builder.h"
+#include "logging.h"
+
+namespace {
+std::string GetString(JNIEnv *env, jstring str) {
+    auto chars = env->GetStringUTFChars(str, nullptr);
+    std::string result(chars);
+    env->ReleaseStringUTFChars(str, chars);
+    return result;
+}
+}
+
+// Builds the superclasses XResources and XTypedArray get reparented to into a sealed memfd,
+// which every process maps instead of generating the same dex again.
+extern "C" JNIEXPORT jint JNICALL
+Java_org_lsposed_lspd_service_DummyDexManager_buildDummyDex(JNIEnv *env, jclass,
+                                                            jstring resource_super_class,
+                                                            jstring typed_array_super_class) {
+    using namespace startop::dex;
+    DexBuilder dex_file;
+
+    ClassBuilder xresource_builder{dex_file.MakeClass("xposed.dummy.XResourcesSuperClass")};
+    xresource_builder.setSuperClass(TypeDescriptor::FromClassname(GetString(env, resource_super_class)));
+
+    ClassBuilder xtypearray_builder{dex_file.MakeClass("xposed.dummy.XTypedArraySuperClass")};
+    xtypearray_builder.setSuperClass(TypeDescriptor::FromClassname(GetString(env, typed_array_super_class)));
+
+    slicer::MemView image{dex_file.CreateImage()};
+
+    // memfd_create has no libc wrapper before API 30, processes build the dex themselves
+    // when the kernel lacks it
+    int fd = static_cast<int>(syscall(__NR_memfd_create, "xposed_dummy_dex",
+                                      MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    if (fd < 0) {
+        PLOGE("memfd_create");
+        return -1;
+    }
+    if (ftruncate(fd, static_cast<off_t>(image.size())) != 0) {
+        PLOGE("ftruncate");
+        close(fd);
+        return -1;
+    }
+    auto *mem = mmap(nullptr, image.size(), PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mem == MAP_FAILED) {
+        PLOGE("mmap");
+        close(fd);
+        return -1;
+    }
+    memcpy(mem, image.ptr(), image.size());
+    munmap(mem, image.size());
+    // processes map it read only, nobody may change the pages under them
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        PLOGE("seal dummy dex");
+        close(fd);
+        return -1;
+    }
+    LOGD("built dummy dex of %zu bytes", image.size());
+    return fd;
+}
@@ -73,6 +73,8 @@ class ZygiskModule : public zygisk::ModuleBase {
     }
 
     void preAppSpecialize(zygisk::AppSpecializeArgs *args) override {
+        auto &timeline = MagiskLoader::GetInstance()->timeline();
+        timeline.Start();
         int cfd = api_->connectCompanion();
         if (cfd < 0) {
             LOGE("Failed to connect to companion: {}", strerror(errno));
@@ -133,6 +135,7 @@ class ZygiskModule : public zygisk::ModuleBase {
         }
 
         close(cfd);
+        timeline.Mark(StartupTimeline::kCompanion);
 
         MagiskLoader::GetInstance()->OnNativeForkAndSpecializePre(
             env_, args->uid, args->gids, args->nice_name,
@@ -0,0 +1,190 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+#include "art_symbol_cache.h"
+
+#include <link.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "config.h"
+#include "elf_util.h"
+#include "logging.h"
+#include "symbol_cache.h"
+
+namespace lspd {
+// Table layout, little endian: u32 build id length + build id, u32 count, then count entries of
+// u8 kind, u32 name length + name and u64 offset, where offset 0 means the symbol is missing.
+enum : uint8_t { kSymbol = 0, kPrefix = 1 };
+
+ArtSymbolCache &ArtSymbolCache::Instance() {
+    static ArtSymbolCache cache;
+    return cache;
+}
+
+ArtSymbolCache::ArtSymbolCache() {
+    dl_iterate_phdr(
+        [](dl_phdr_info *info, size_t, void *data) {
+            std::string_view name = info->dlpi_name ? info->dlpi_name : "";
+            std::string_view art = kLibArtName;
+            if (name.size() <= art.size() || !name.ends_with(art) ||
+                name[name.size() - art.size() - 1] != '/') {
+                return 0;
+            }
+            auto *self = static_cast<ArtSymbolCache *>(data);
+            self->base_ = info->dlpi_addr;
+            for (int i = 0; i < info->dlpi_phnum; ++i) {
+                const auto &phdr = info->dlpi_phdr[i];
+                if (phdr.p_type == PT_LOAD) {
+                    self->span_ = std::max<uint64_t>(self->span_, phdr.p_vaddr + phdr.p_memsz);
+                }
+                if (phdr.p_type != PT_NOTE) continue;
+                auto *note = reinterpret_cast<const uint8_t *>(info->dlpi_addr + phdr.p_vaddr);
+                for (size_t pos = 0; pos + sizeof(ElfW(Nhdr)) <= phdr.p_memsz;) {
+                    auto *nhdr = reinterpret_cast<const ElfW(Nhdr) *>(note + pos);
+                    auto name_size = (nhdr->n_namesz + 3) & ~3u;
+                    auto desc_size = (nhdr->n_descsz + 3) & ~3u;
+                    auto *desc = note + pos + sizeof(ElfW(Nhdr)) + name_size;
+                    if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+                        memcmp(note + pos + sizeof(ElfW(Nhdr)), "GNU", 4) == 0) {
+                        static constexpr char kHex[] = "0123456789abcdef";
+                        for (size_t j = 0; j < nhdr->n_descsz; ++j) {
+                            self->build_id_.push_back(kHex[desc[j] >> 4]);
+                            self->build_id_.push_back(kHex[desc[j] & 0xf]);
+                        }
+                        break;
+                    }
+                    pos += sizeof(ElfW(Nhdr)) + name_size + desc_size;
+                }
+            }
+            return 1;
+        },
+        this);
+    // without a base or build id nothing can be cached, everything goes to libart
+    if (!base_) build_id_.clear();
+    LOGD("libart base {:#x}, build id {}", base_, build_id_);
+}
+
+void *ArtSymbolCache::Address(uint64_t offset) const {
+    return offset ? reinterpret_cast<void *>(base_ + offset) : nullptr;
+}
+
+void ArtSymbolCache::Record(Offsets &offsets, std::string_view name, void *address) {
+    if (build_id_.empty()) return;
+    auto target = reinterpret_cast<uintptr_t>(address);
+    // addresses outside of libart cannot be told relative to its base
+    if (address && (target <= base_ || target - base_ >= span_)) return;
+    offsets.emplace(name, address ? target - base_ : 0);
+    recorded_ = true;
+}
+
+void *ArtSymbolCache::Resolve(std::string_view symbol) {
+    std::lock_guard lk(lock_);
+    if (auto i = symbols_.find(symbol); i != symbols_.end()) return Address(i->second);
+    auto *address = GetArt()->getSymbAddress(symbol);
+    Record(symbols_, symbol, address);
+    return address;
+}
+
+void *ArtSymbolCache::ResolvePrefix(std::string_view prefix) {
+    std::lock_guard lk(lock_);
+    if (auto i = prefixes_.find(prefix); i != prefixes_.end()) return Address(i->second);
+    auto *address = GetArt()->getSymbPrefixFirstAddress(prefix);
+    Record(prefixes_, prefix, address);
+    return address;
+}
+
+bool ArtSymbolCache::Parse(const uint8_t *data, size_t size) {
+    size_t pos = 0;
+    auto read = [&](void *out, size_t length) {
+        if (size - pos < length) return false;
+        memcpy(out, data + pos, length);
+        pos += length;
+        return true;
+    };
+    auto read_string = [&](std::string_view &out) {
+        uint32_t length;
+        if (!read(&length, sizeof(length)) || size - pos < length) return false;
+        out = {reinterpret_cast<const char *>(data + pos), length};
+        pos += length;
+        return true;
+    };
+    std::string_view build_id;
+    if (!read_string(build_id) || build_id != build_id_) return false;
+    uint32_t count;
+    if (!read(&count, sizeof(count))) return false;
+    Offsets symbols, prefixes;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t kind;
+        std::string_view name;
+        uint64_t offset;
+        if (!read(&kind, sizeof(kind)) || !read_string(name) || !read(&offset, sizeof(offset))) {
+            return false;
+        }
+        if (kind > kPrefix || offset >= span_) return false;
+        (kind == kSymbol ? symbols : prefixes).emplace(name, offset);
+    }
+    symbols_ = std::move(symbols);
+    prefixes_ = std::move(prefixes);
+    return true;
+}
+
+bool ArtSymbolCache::Load(int fd, size_t size) {
+    if (fd < 0 || build_id_.empty()) return false;
+    auto *data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) return false;
+    std::lock_guard lk(lock_);
+    loaded_ = Parse(static_cast<const uint8_t *>(data), size);
+    munmap(data, size);
+    if (loaded_) {
+        LOGD("loaded {} art symbols and {} prefixes", symbols_.size(), prefixes_.size());
+    } else {
+        LOGW("dropped art symbol table not made for libart {}", build_id_);
+    }
+    return loaded_;
+}
+
+std::vector<uint8_t> ArtSymbolCache::Pack() {
+    std::lock_guard lk(lock_);
+    std::vector<uint8_t> out;
+    if (loaded_ || !recorded_) return out;
+    auto write = [&](const void *in, size_t length) {
+        auto *bytes = static_cast<const uint8_t *>(in);
+        out.insert(out.end(), bytes, bytes + length);
+    };
+    auto write_string = [&](std::string_view s) {
+        auto length = static_cast<uint32_t>(s.size());
+        write(&length, sizeof(length));
+        write(s.data(), s.size());
+    };
+    write_string(build_id_);
+    auto count = static_cast<uint32_t>(symbols_.size() + prefixes_.size());
+    write(&count, sizeof(count));
+    for (auto [kind, offsets] : {std::pair{kSymbol, &symbols_}, std::pair{kPrefix, &prefixes_}}) {
+        for (const auto &[name, offset] : *offsets) {
+            write(&kind, sizeof(kind));
+            write_string(name);
+            write(&offset, sizeof(offset));
+        }
+    }
+    return out;
+}
+}  // namespace lspd
@@ -0,0 +1,72 @@
+/*
+ * This file is part of LSPosed.
+ *
+ * LSPosed is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * LSPosed is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with LSPosed.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * Copyright (C) 2024 LSPosed Contributors
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <parallel_hashmap/phmap.h>
+
+namespace lspd {
+// Offsets from the load base of the libart symbols lsplant asks for. They are the same in every
+// process mapping the same libart, so a table recorded once per boot lets later processes resolve
+// them without parsing libart. Tables are tied to the build id of the libart they were made for.
+class ArtSymbolCache {
+public:
+    static ArtSymbolCache &Instance();
+
+    // hex build id of the libart in this process, empty if it cannot be cached
+    const std::string &build_id() const { return build_id_; }
+
+    // Takes a table from the daemon, it is dropped as a whole unless it fits this libart
+    bool Load(int fd, size_t size);
+
+    void *Resolve(std::string_view symbol);
+
+    void *ResolvePrefix(std::string_view prefix);
+
+    // what this process resolved by parsing libart, empty if a table was loaded or nothing was
+    std::vector<uint8_t> Pack();
+
+private:
+    using Offsets = phmap::flat_hash_map<std::string, uint64_t>;
+
+    ArtSymbolCache();
+
+    bool Parse(const uint8_t *data, size_t size);
+
+    void *Address(uint64_t offset) const;
+
+    void Record(Offsets &offsets, std::string_view name, void *address);
+
+    std::mutex lock_;
+    uintptr_t base_ = 0;
+    // end of the highest segment, offsets beyond it do not belong to libart
+    uint64_t span_ = 0;
+    std::string build_id_;
+    bool loaded_ = false;
+    bool recorded_ = false;
+    Offsets symbols_;
+    Offsets prefixes_;
+};
+}  // namespace lspd
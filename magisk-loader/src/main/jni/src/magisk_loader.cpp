@@ -75,6 +75,46 @@ void MagiskLoader::LoadDex(JNIEnv *env, PreloadedDex &&dex) {
     env->DeleteLocalRef(dex_buffer);
 }
 
+bool MagiskLoader::LoadCompiledDex(JNIEnv *env, const std::string &path) {
+    if (path.empty()) return false;
+    auto classloader = JNI_FindClass(env, "java/lang/ClassLoader");
+    auto getsyscl_mid = JNI_GetStaticMethodID(env, classloader, "getSystemClassLoader",
+                                              "()Ljava/lang/ClassLoader;");
+    auto sys_classloader = JNI_CallStaticObjectMethod(env, classloader, getsyscl_mid);
+    if (!sys_classloader) [[unlikely]] {
+        LOGE("getSystemClassLoader failed!!!");
+        return false;
+    }
+    // the same parent as LoadDex, the daemon tells dex2oat the dex is loaded under it;
+    // ART falls back to the dex itself if it rejects the odex next to it
+    auto path_classloader = JNI_FindClass(env, "dalvik/system/PathClassLoader");
+    auto initMid = JNI_GetMethodID(env, path_classloader, "<init>",
+                                   "(Ljava/lang/String;Ljava/lang/ClassLoader;)V");
+    if (auto my_cl = JNI_NewObject(env, path_classloader, initMid, JNI_NewStringUTF(env, path),
+                                   sys_classloader)) {
+        inject_class_loader_ = JNI_NewGlobalRef(env, my_cl);
+        LOGD("loaded compiled framework dex from {}", path);
+        return true;
+    }
+    LOGW("PathClassLoader creation failed for {}", path);
+    return false;
+}
+
+void MagiskLoader::InitArtHookerWithCache(JNIEnv *env, const ScopedLocalRef<jobject> &binder,
+                                          int art_symbols_fd, size_t art_symbols_size,
+                                          bool share) {
+    auto &cache = ArtSymbolCache::Instance();
+    if (art_symbols_fd >= 0) {
+        cache.Load(art_symbols_fd, art_symbols_size);
+        close(art_symbols_fd);
+    }
+    InitArtHooker(env, initInfo);
+    if (!share) return;
+    if (auto table = cache.Pack(); !table.empty()) {
+        Service::instance()->ReportArtSymbols(env, binder, cache.build_id(), table);
+    }
+}
+
 std::string GetEntryClassName() {
     const auto &obfs_map = ConfigBridge::GetInstance()->obfuscation_map();
     static auto signature = obfs_map.at("org.lsposed.lspd.core.") + "Main";
@@ -88,12 +128,15 @@ void MagiskLoader::SetupEntryClass(JNIEnv *env) {
 }
 
 void MagiskLoader::OnNativeForkSystemServerPre(JNIEnv *env) {
+    timeline_.Start();
     Service::instance()->InitService(env);
     setAllowUnload(skip_);
+    timeline_.Mark(StartupTimeline::kSpecializePre);
 }
 
 void MagiskLoader::OnNativeForkSystemServerPost(JNIEnv *env) {
     if (!skip_) {
+        timeline_.Resume();
         auto *instance = Service::instance();
         auto system_server_binder = instance->RequestSystemServerBinder(env);
         if (!system_server_binder) {
@@ -107,21 +150,33 @@ void MagiskLoader::OnNativeForkSystemServerPost(JNIEnv *env) {
         // Call application_binder directly if application binder is available,
         // or we proxy the request from system server binder
         auto &&next_binder = application_binder ? application_binder : system_server_binder;
-        const auto [dex_fd, size] = instance->RequestLSPDex(env, next_binder);
-        auto obfs_map = instance->RequestObfuscationMap(env, next_binder);
-        ConfigBridge::GetInstance()->obfuscation_map(std::move(obfs_map));
-        LoadDex(env, PreloadedDex(dex_fd, size));
-        close(dex_fd);
+        timeline_.Mark(StartupTimeline::kRequestBinder);
+        auto bootstrap =
+            instance->RequestBootstrap(env, next_binder, ArtSymbolCache::Instance().build_id());
+        ConfigBridge::GetInstance()->obfuscation_map(std::move(bootstrap.obfuscation_map));
+        timeline_.Mark(StartupTimeline::kBootstrap);
+        if (!LoadCompiledDex(env, bootstrap.compiled_dex_path)) {
+            LoadDex(env, PreloadedDex(bootstrap.dex_fd, bootstrap.dex_size));
+        }
+        close(bootstrap.dex_fd);
         instance->HookBridge(*this, env);
+        timeline_.Mark(StartupTimeline::kLoadDex);
 
         // always inject into system server
-        InitArtHooker(env, initInfo);
+        InitArtHookerWithCache(env, next_binder, bootstrap.art_symbols_fd,
+                               bootstrap.art_symbols_size, true);
+        timeline_.Mark(StartupTimeline::kInitArtHooker);
         InitHooks(env);
+        timeline_.Mark(StartupTimeline::kInitHooks);
         SetupEntryClass(env);
+        timeline_.Mark(StartupTimeline::kSetupEntryClass);
+        auto system_name = JNI_NewStringUTF(env, "system");
         FindAndCall(env, "forkCommon",
                     "(ZLjava/lang/String;Ljava/lang/String;Landroid/os/IBinder;)V", JNI_TRUE,
-                    JNI_NewStringUTF(env, "system"), nullptr, application_binder,
+                    system_name, nullptr, application_binder,
                     is_parasitic_manager);
+        timeline_.Mark(StartupTimeline::kForkCommon);
+        instance->ReportStartupTimeline(env, next_binder, timeline_);
         GetArt(true);
     }
 }
@@ -167,27 +222,40 @@ void MagiskLoader::OnNativeForkAndSpecializePre(JNIEnv *env, jint uid, jintArray
         LOGI("skip injecting into {} because it's isolated", process_name.get());
     }
     setAllowUnload(skip_);
+    timeline_.Mark(StartupTimeline::kSpecializePre);
 }
 
 void MagiskLoader::OnNativeForkAndSpecializePost(JNIEnv *env, jstring nice_name, jstring app_dir) {
     const JUTFString process_name(env, nice_name);
+    timeline_.Resume();
     auto *instance = Service::instance();
     if (is_parasitic_manager) nice_name = JNI_NewStringUTF(env, "org.lsposed.manager").release();
     auto binder =
         skip_ ? ScopedLocalRef<jobject>{env, nullptr} : instance->RequestBinder(env, nice_name);
     if (binder) {
-        auto [dex_fd, size] = instance->RequestLSPDex(env, binder);
-        auto obfs_map = instance->RequestObfuscationMap(env, binder);
-        ConfigBridge::GetInstance()->obfuscation_map(std::move(obfs_map));
-        LoadDex(env, PreloadedDex(dex_fd, size));
-        close(dex_fd);
-        InitArtHooker(env, initInfo);
+        timeline_.Mark(StartupTimeline::kRequestBinder);
+        auto bootstrap =
+            instance->RequestBootstrap(env, binder, ArtSymbolCache::Instance().build_id());
+        ConfigBridge::GetInstance()->obfuscation_map(std::move(bootstrap.obfuscation_map));
+        timeline_.Mark(StartupTimeline::kBootstrap);
+        if (!LoadCompiledDex(env, bootstrap.compiled_dex_path)) {
+            LoadDex(env, PreloadedDex(bootstrap.dex_fd, bootstrap.dex_size));
+        }
+        close(bootstrap.dex_fd);
+        timeline_.Mark(StartupTimeline::kLoadDex);
+        InitArtHookerWithCache(env, binder, bootstrap.art_symbols_fd, bootstrap.art_symbols_size,
+                               false);
+        timeline_.Mark(StartupTimeline::kInitArtHooker);
         InitHooks(env);
+        timeline_.Mark(StartupTimeline::kInitHooks);
         SetupEntryClass(env);
+        timeline_.Mark(StartupTimeline::kSetupEntryClass);
         LOGD("Done prepare");
         FindAndCall(env, "forkCommon",
                     "(ZLjava/lang/String;Ljava/lang/String;Landroid/os/IBinder;)V", JNI_FALSE,
                     nice_name, app_dir, binder);
+        timeline_.Mark(StartupTimeline::kForkCommon);
+        instance->ReportStartupTimeline(env, binder, timeline_);
         LOGD("injected xposed into {}", process_name.get());
         setAllowUnload(false);
         GetArt(true);
@@ -24,8 +24,10 @@
 #pragma once
 
 #include "../src/native_api.h"
+#include "art_symbol_cache.h"
 #include "context.h"
 #include "elf_util.h"
+#include "startup_timeline.h"
 #include "symbol_cache.h"
 
 namespace lspd {
@@ -46,13 +48,25 @@ public:
 
     void OnNativeForkSystemServerPost(JNIEnv *env);
 
+    StartupTimeline &timeline() { return timeline_; }
+
 protected:
     void LoadDex(JNIEnv *env, PreloadedDex &&dex) override;
 
     void SetupEntryClass(JNIEnv *env) override;
 
 private:
+    // Loads the daemon's on-disk copy of the framework dex so that ART can use its odex
+    bool LoadCompiledDex(JNIEnv *env, const std::string &path);
+
+    // Initializes lsplant with the art symbols from the bootstrap reply. If there were none and
+    // share is set, hands the ones it resolved to the daemon; it only takes them from the system
+    // server, so apps keep theirs
+    void InitArtHookerWithCache(JNIEnv *env, const lsplant::ScopedLocalRef<jobject> &binder,
+                                int art_symbols_fd, size_t art_symbols_size, bool share);
+
     bool skip_ = false;
+    StartupTimeline timeline_;
     const lsplant::InitInfo initInfo = lsplant::InitInfo{
         .inline_hooker =
             [](auto t, auto r) {
@@ -60,9 +74,10 @@ private:
                 return HookInline(t, r, &bk) == 0 ? bk : nullptr;
             },
         .inline_unhooker = [](auto t) { return UnhookInline(t) == 0; },
-        .art_symbol_resolver = [](auto symbol) { return GetArt()->getSymbAddress(symbol); },
+        .art_symbol_resolver =
+            [](auto symbol) { return ArtSymbolCache::Instance().Resolve(symbol); },
         .art_symbol_prefix_resolver =
-            [](auto symbol) { return GetArt()->getSymbPrefixFirstAddress(symbol); },
+            [](auto symbol) { return ArtSymbolCache::Instance().ResolvePrefix(symbol); },
     };
 
     static void setAllowUnload(bool unload);
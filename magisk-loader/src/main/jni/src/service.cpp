@@ -21,6 +21,10 @@
 // Created by loves on 2/7/2021.
 //
 
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
+#include <optional>
 #include <thread>
 #include <atomic>
 #include "loader.h"
@@ -157,6 +161,8 @@ namespace lspd {
         write_interface_token_method_ = JNI_GetMethodID(env, parcel_class_, "writeInterfaceToken",
                                                         "(Ljava/lang/String;)V");
         write_int_method_ = JNI_GetMethodID(env, parcel_class_, "writeInt", "(I)V");
+        write_long_method_ = JNI_GetMethodID(env, parcel_class_, "writeLong", "(J)V");
+        write_byte_array_method_ = JNI_GetMethodID(env, parcel_class_, "writeByteArray", "([B)V");
         write_string_method_ = JNI_GetMethodID(env, parcel_class_, "writeString",
                                                "(Ljava/lang/String;)V");
         write_strong_binder_method_ = JNI_GetMethodID(env, parcel_class_, "writeStrongBinder",
@@ -392,4 +398,103 @@ namespace lspd {
 
         return ret;
     }
+
+    // see LSPApplicationService.getPackedObfuscationMap for the layout
+    static std::optional<std::map<std::string, std::string>> ParseObfuscationMap(const uint8_t *data,
+                                                                                 size_t size) {
+        std::map<std::string, std::string> ret;
+        size_t pos = 0;
+        auto read_u32 = [&](uint32_t &out) {
+            if (size - pos < sizeof(out)) return false;
+            memcpy(&out, data + pos, sizeof(out));
+            pos += sizeof(out);
+            return true;
+        };
+        auto read_string = [&](std::string &out) {
+            uint32_t length;
+            if (!read_u32(length) || size - pos < length) return false;
+            out.assign(reinterpret_cast<const char *>(data + pos), length);
+            pos += length;
+            return true;
+        };
+        uint32_t count;
+        if (!read_u32(count)) return std::nullopt;
+        for (uint32_t i = 0; i < count; i++) {
+            std::string key, value;
+            if (!read_string(key) || !read_string(value)) return std::nullopt;
+            ret.emplace(std::move(key), std::move(value));
+        }
+        return ret;
+    }
+
+    Service::Bootstrap Service::RequestBootstrap(JNIEnv *env, const ScopedLocalRef<jobject> &binder,
+                                                 const std::string &art_build_id) {
+        Bootstrap bootstrap;
+        {
+            Wrapper wrapper{env, this};
+            JNI_CallVoidMethod(env, wrapper.data, write_string_method_, JNI_NewStringUTF(env, art_build_id));
+            if (wrapper.transact(binder, BOOTSTRAP_TRANSACTION_CODE)) {
+                auto read_fd = [&] {
+                    auto parcel_fd = JNI_CallObjectMethod(env, wrapper.reply, read_file_descriptor_method_);
+                    return parcel_fd ? JNI_CallIntMethod(env, parcel_fd, detach_fd_method_) : -1;
+                };
+                bootstrap.dex_fd = read_fd();
+                bootstrap.dex_size = static_cast<size_t>(JNI_CallLongMethod(env, wrapper.reply, read_long_method_));
+                int map_fd = read_fd();
+                auto map_size = static_cast<size_t>(JNI_CallLongMethod(env, wrapper.reply, read_long_method_));
+                std::optional<std::map<std::string, std::string>> map;
+                if (map_fd >= 0) {
+                    if (auto *data = mmap(nullptr, map_size, PROT_READ, MAP_SHARED, map_fd, 0); data != MAP_FAILED) {
+                        map = ParseObfuscationMap(static_cast<const uint8_t *>(data), map_size);
+                        munmap(data, map_size);
+                    }
+                    close(map_fd);
+                }
+                if (bootstrap.dex_fd >= 0 && map) {
+                    bootstrap.obfuscation_map = std::move(*map);
+                    if (auto path = JNI_Cast<jstring>(JNI_CallObjectMethod(env, wrapper.reply, read_string_method_))) {
+                        bootstrap.compiled_dex_path = JUTFString(path).get();
+                    }
+                    if (JNI_CallIntMethod(env, wrapper.reply, read_int_method_) != 0) {
+                        bootstrap.art_symbols_fd = read_fd();
+                        bootstrap.art_symbols_size = static_cast<size_t>(JNI_CallLongMethod(env, wrapper.reply, read_long_method_));
+                    }
+                    LOGD("bootstrap: dex fd={}, size={}, {} obfuscated signatures", bootstrap.dex_fd,
+                         bootstrap.dex_size, bootstrap.obfuscation_map.size());
+                    return bootstrap;
+                }
+                if (bootstrap.dex_fd >= 0) close(bootstrap.dex_fd);
+            }
+        }
+        LOGW("Service::RequestBootstrap: falling back to separate transactions");
+        std::tie(bootstrap.dex_fd, bootstrap.dex_size) = RequestLSPDex(env, binder);
+        bootstrap.obfuscation_map = RequestObfuscationMap(env, binder);
+        return bootstrap;
+    }
+
+    void Service::ReportStartupTimeline(JNIEnv *env, const ScopedLocalRef<jobject> &binder,
+                                        const StartupTimeline &timeline) {
+        Wrapper wrapper{env, this};
+        JNI_CallVoidMethod(env, wrapper.data, write_int_method_, getpid());
+        JNI_CallVoidMethod(env, wrapper.data, write_int_method_, static_cast<jint>(StartupTimeline::kPhaseCount));
+        for (auto duration : timeline.durations()) {
+            JNI_CallVoidMethod(env, wrapper.data, write_long_method_, static_cast<jlong>(duration));
+        }
+        if (!wrapper.transact(binder, STARTUP_TIMELINE_TRANSACTION_CODE, FLAG_ONEWAY)) {
+            LOGW("Service::ReportStartupTimeline: transaction failed");
+        }
+    }
+
+    void Service::ReportArtSymbols(JNIEnv *env, const ScopedLocalRef<jobject> &binder,
+                                   const std::string &art_build_id, const std::vector<uint8_t> &table) {
+        Wrapper wrapper{env, this};
+        auto bytes = ScopedLocalRef(env, env->NewByteArray(static_cast<jsize>(table.size())));
+        env->SetByteArrayRegion(bytes.get(), 0, static_cast<jsize>(table.size()),
+                                reinterpret_cast<const jbyte *>(table.data()));
+        JNI_CallVoidMethod(env, wrapper.data, write_string_method_, JNI_NewStringUTF(env, art_build_id));
+        JNI_CallVoidMethod(env, wrapper.data, write_byte_array_method_, bytes);
+        if (!wrapper.transact(binder, ART_SYMBOLS_TRANSACTION_CODE)) {
+            LOGW("Service::ReportArtSymbols: transaction failed");
+        }
+    }
 }  // namespace lspd
@@ -25,8 +25,10 @@
 #define LSPOSED_SERVICE_H
 
 #include <map>
+#include <vector>
 #include <jni.h>
 #include "context.h"
+#include "startup_timeline.h"
 
 using namespace std::literals::string_view_literals;
 
@@ -34,6 +36,10 @@ namespace lspd {
     class Service {
         constexpr static jint DEX_TRANSACTION_CODE = 1310096052;
         constexpr static jint OBFUSCATION_MAP_TRANSACTION_CODE = 724533732;
+        constexpr static jint BOOTSTRAP_TRANSACTION_CODE = 1112493140;
+        constexpr static jint STARTUP_TIMELINE_TRANSACTION_CODE = 1414090316;
+        constexpr static jint ART_SYMBOLS_TRANSACTION_CODE = 1095914323;
+        constexpr static jint FLAG_ONEWAY = 1;
         constexpr static jint BRIDGE_TRANSACTION_CODE = 1598837584;
         constexpr static auto BRIDGE_SERVICE_DESCRIPTOR = "LSPosed"sv;
         constexpr static auto BRIDGE_SERVICE_NAME = "activity"sv;
@@ -55,9 +61,10 @@ namespace lspd {
             reply(lsplant::JNI_CallStaticObjectMethod(env, service->parcel_class_, service->obtain_method_))
             {}
 
-            inline bool transact(const lsplant::ScopedLocalRef<jobject> &binder, jint transaction_code) {
+            inline bool transact(const lsplant::ScopedLocalRef<jobject> &binder, jint transaction_code,
+                                 jint flags = 0) {
                 return JNI_CallBooleanMethod(env_, binder, service_->transact_method_,transaction_code,
-                                      data, reply, 0);
+                                      data, reply, flags);
             }
 
             inline ~Wrapper() {
@@ -67,6 +74,17 @@ namespace lspd {
         };
 
     public:
+        struct Bootstrap {
+            int dex_fd = -1;
+            size_t dex_size = 0;
+            std::map<std::string, std::string> obfuscation_map;
+            // the same dex on disk with its odex, empty if the daemon has not compiled it
+            std::string compiled_dex_path;
+            // offsets of art symbols recorded for the requested libart build id, -1 if none yet
+            int art_symbols_fd = -1;
+            size_t art_symbols_size = 0;
+        };
+
         inline static Service* instance() {
             return instance_.get();
         }
@@ -88,6 +106,20 @@ namespace lspd {
 
         std::map<std::string, std::string> RequestObfuscationMap(JNIEnv *env, const lsplant::ScopedLocalRef<jobject> &binder);
 
+        // the dex and the obfuscation map with one transaction
+        Bootstrap RequestBootstrap(JNIEnv *env, const lsplant::ScopedLocalRef<jobject> &binder,
+                                   const std::string &art_build_id);
+
+        // oneway, the process does not wait for the daemon to take it; the daemon files it under
+        // the name this process registered with
+        void ReportStartupTimeline(JNIEnv *env, const lsplant::ScopedLocalRef<jobject> &binder,
+                                   const StartupTimeline &timeline);
+
+        // hands the art symbols this process resolved to the daemon for later ones, only taken from
+        // the system server; synchronous so that the daemon can tell who is calling
+        void ReportArtSymbols(JNIEnv *env, const lsplant::ScopedLocalRef<jobject> &binder,
+                              const std::string &art_build_id, const std::vector<uint8_t> &table);
+
     private:
         static std::unique_ptr<Service> instance_;
         bool initialized_ = false;
@@ -122,6 +154,8 @@ namespace lspd {
         jmethodID recycleMethod_ = nullptr;
         jmethodID write_interface_token_method_ = nullptr;
         jmethodID write_int_method_ = nullptr;
+        jmethodID write_long_method_ = nullptr;
+        jmethodID write_byte_array_method_ = nullptr;
         jmethodID write_string_method_ = nullptr;
         jmethodID read_exception_method_ = nullptr;
         jmethodID read_strong_binder_method_ = nullptr;